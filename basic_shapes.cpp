@@ -1,129 +1,1071 @@
 #define EPS
 #include "eps/eps_basic_shapes.h"
 
-#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EPS_SSE2
+#endif
+
+// AVX2 is compiled in for x86 and only used when the processor has it.
+#if defined(EPS_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define EPS_TARGET_AVX2
+#else
+#define EPS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#define EPS_AVX2
+#endif
 
 namespace // anonymous
 {
 
-class beginpoint_t
-    : public eps::section_t
+// Opcodes of the sections of a path_t. The points of a section are stored
+// consecutively in m_, the begin point of a section is the last point of the
+// previous one.
+enum section_op_t : uint8_t
 {
-public:
-    beginpoint_t(int a) : m_a(a) {}
-    int m_a;
+    op_moveto,     // p
+    op_lineto,     // b
+    op_curveto,    // ai, bi, b
+    op_arcto,      // c, ax, ay, b
+    op_closepath,
+    op_lines,      // n x b
+    op_curves      // n x (ai, bi, b)
 };
 
-class linesection_t
-    : public eps::section_t
+// op_lines and op_curves are followed by their count n in the next
+// count_size opcode bytes, so that a whole run is one compact section.
+size_t const count_size = 4;
+
+void push_count(std::pmr::vector<uint8_t>& ops, size_t n)
 {
-public:
-    linesection_t(int b) : m_b(b) {}
-    int m_b;
-};
+    uint32_t const count = static_cast<uint32_t>(n);
+    uint8_t bytes[count_size];
+    std::memcpy(bytes, &count, count_size);
+    ops.insert(ops.end(), bytes, bytes + count_size);
+}
 
-class beziersection_t
-    : public eps::section_t
+size_t count_at(uint8_t const* bytes)
 {
-public:
-    beziersection_t(int a, int ai, int bi, int b) : m_a(a), m_ai(ai), m_bi(bi), m_b(b) {}
-    int m_a;
-    int m_ai;
-    int m_bi;
-    int m_b;
-};
+    uint32_t count;
+    std::memcpy(&count, bytes, count_size);
+    return count;
+}
 
-class arcsection_t
-    : public eps::section_t
+// Curves and arcs begin at the current point, p[-1]; a path cannot start
+// with one.
+void check_current_point(eps::point_t const* p, eps::point_t const* first)
 {
-public:
-    arcsection_t(int a, int c, int ax, int ay, int b) : m_a(a), m_c(c), m_ax(ax), m_ay(ay), m_b(b) {}
-    int m_a;
-    int m_c;
-    int m_ax;
-    int m_ay;
-    int m_b;
+    if (p == first)
+    {
+        THROW(std::logic_error, "E0106", << "A curve or arc needs a current point, add a moveto first");
+    }
+}
+
+static_assert(sizeof(eps::point_t) == 2 * sizeof(float), "point_t must be two packed floats");
+
+eps::area_t points_bounding_box(eps::point_t const* points, size_t n)
+{
+    eps::area_t area = eps::null_bounding_box();
+    for (size_t i = 0; i < n; ++i)
+    {
+        eps::min_bounding_box(area.m_min, points[i]);
+        eps::max_bounding_box(area.m_max, points[i]);
+    }
+    return area;
+}
+
+// Bounding boxes of runs of curves and arcs. The vector versions work on
+// several segments at once, the control points of each are gathered into
+// the lanes of a register: a curve takes two neighbouring lanes, x and y,
+// an arc takes one lane per coordinate register. They compute what
+// eps::bezier_bounding_box and eps::arc_bounding_box compute, the arcs
+// compare pseudo-angles instead of calling atan2. kernels() picks AVX2
+// when the processor has it, else SSE2, else the scalar loops.
+
+// Bounding box of n beziers that follow the current point points[-1].
+eps::area_t curves_bounding_box_scalar(eps::point_t const* points, size_t n, float epsilon)
+{
+    eps::area_t area = eps::null_bounding_box();
+    for (size_t i = 0; i < n; ++i, points += 3)
+    {
+        eps::area_t bb = eps::bezier_bounding_box(points[-1], points[0], points[1], points[2], epsilon);
+        eps::min_bounding_box(area.m_min, bb.m_min);
+        eps::max_bounding_box(area.m_max, bb.m_max);
+    }
+    return area;
+}
+
+// Bounding box of n arcs (c, ax, ay, b) that follow the current point
+// points[-1].
+eps::area_t arcs_bounding_box_scalar(eps::point_t const* points, size_t n, float epsilon)
+{
+    eps::area_t area = eps::null_bounding_box();
+    for (size_t i = 0; i < n; ++i, points += 4)
+    {
+        eps::area_t bb = eps::arc_bounding_box(points[-1], points[0], points[1] - points[0], points[2] - points[0], points[3], epsilon);
+        eps::min_bounding_box(area.m_min, bb.m_min);
+        eps::max_bounding_box(area.m_max, bb.m_max);
+    }
+    return area;
+}
+
+// Adds the lanes of lo and hi, stored in l and h, to the area. Curves
+// alternate x and y over the lanes.
+void reduce_curve_lanes(float const* l, float const* h, size_t lanes, eps::area_t& area)
+{
+    for (size_t j = 0; j < lanes; j += 2)
+    {
+        eps::min_bounding_box(area.m_min, eps::point_t(l[j], l[j + 1]));
+        eps::max_bounding_box(area.m_max, eps::point_t(h[j], h[j + 1]));
+    }
+}
+
+// The control points of arcs, one array per coordinate, lanes arcs wide.
+// Gathering and reducing are inline, a call from the AVX2 kernel in between
+// its instructions would switch to and from the legacy SSE encoding.
+enum arc_coordinate_t { arc_ax, arc_ay, arc_cx, arc_cy, arc_xx, arc_xy, arc_yx, arc_yy, arc_bx, arc_by, arc_coordinates };
+
+inline void gather_arcs(eps::point_t const* points, size_t lanes, float* g)
+{
+    for (size_t j = 0; j < lanes; ++j, points += 4)
+    {
+        g[arc_ax * lanes + j] = points[-1].m_x;
+        g[arc_ay * lanes + j] = points[-1].m_y;
+        g[arc_cx * lanes + j] = points[0].m_x;
+        g[arc_cy * lanes + j] = points[0].m_y;
+        g[arc_xx * lanes + j] = points[1].m_x - points[0].m_x;
+        g[arc_xy * lanes + j] = points[1].m_y - points[0].m_y;
+        g[arc_yx * lanes + j] = points[2].m_x - points[0].m_x;
+        g[arc_yy * lanes + j] = points[2].m_y - points[0].m_y;
+        g[arc_bx * lanes + j] = points[3].m_x;
+        g[arc_by * lanes + j] = points[3].m_y;
+    }
+}
+
+// Arcs have one lane each, lo and hi hold x and y in l and h.
+inline void reduce_arc_lanes(float const* l, float const* h, size_t lanes, eps::area_t& area)
+{
+    for (size_t j = 0; j < lanes; ++j)
+    {
+        eps::min_bounding_box(area.m_min, eps::point_t(l[j], l[lanes + j]));
+        eps::max_bounding_box(area.m_max, eps::point_t(h[j], h[lanes + j]));
+    }
+}
+
+#ifdef EPS_SSE2
+
+__m128 select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// p in the low and q in the high half
+__m128 load_points(eps::point_t const* p, eps::point_t const* q)
+{
+    return _mm_castpd_ps(_mm_loadh_pd(_mm_load_sd(reinterpret_cast<double const*>(p)), reinterpret_cast<double const*>(q)));
+}
+
+// The extremes of two curves: the derivative a t^2 + b t + c of each axis
+// is solved as abc_formula does, the roots are clipped to [0, 1] and the
+// curve evaluated there as eps::bezier does.
+void curves_extremes(__m128 a, __m128 ai, __m128 bi, __m128 b, __m128 epsilon, __m128& lo, __m128& hi)
+{
+    __m128 const sign = _mm_set1_ps(-0.f);
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const one = _mm_set1_ps(1.f);
+    __m128 const two = _mm_set1_ps(2.f);
+    __m128 const three = _mm_set1_ps(3.f);
+    __m128 const four = _mm_set1_ps(4.f);
+    __m128 const qa = _mm_add_ps(_mm_sub_ps(_mm_add_ps(_mm_xor_ps(a, sign), _mm_mul_ps(three, ai)), _mm_mul_ps(three, bi)), b);
+    __m128 const qb = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(two, a), _mm_mul_ps(four, ai)), _mm_mul_ps(two, bi));
+    __m128 const qc = _mm_sub_ps(ai, a);
+    __m128 const linear = _mm_cmple_ps(_mm_andnot_ps(sign, qa), epsilon);
+    __m128 const sloped = _mm_cmpgt_ps(_mm_andnot_ps(sign, qb), epsilon);
+    __m128 const tl = _mm_and_ps(sloped, _mm_div_ps(_mm_xor_ps(qc, sign), qb));
+    __m128 const d = _mm_sub_ps(_mm_mul_ps(qb, qb), _mm_mul_ps(_mm_mul_ps(four, qa), qc));
+    __m128 const real = _mm_cmpge_ps(d, zero);
+    __m128 const root = _mm_sqrt_ps(_mm_max_ps(d, zero));
+    __m128 const nb = _mm_xor_ps(qb, sign);
+    __m128 const twice = _mm_mul_ps(two, qa);
+    __m128 const t[2] = {
+        select(linear, tl, _mm_and_ps(real, _mm_div_ps(_mm_add_ps(nb, root), twice))),
+        select(linear, tl, _mm_and_ps(real, _mm_div_ps(_mm_sub_ps(nb, root), twice)))
+    };
+    lo = _mm_min_ps(_mm_min_ps(a, b), lo);
+    hi = _mm_max_ps(_mm_max_ps(a, b), hi);
+    for (__m128 u : t)
+    {
+        u = _mm_min_ps(_mm_max_ps(u, zero), one);
+        __m128 const s = _mm_sub_ps(one, u);
+        __m128 const v = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(s, s), s), a),
+            _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_mul_ps(three, s), s), u), ai)),
+            _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_mul_ps(three, s), u), u), bi)),
+            _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(u, u), u), b));
+        lo = _mm_min_ps(v, lo);
+        hi = _mm_max_ps(v, hi);
+    }
+}
+
+eps::area_t curves_bounding_box_sse2(eps::point_t const* points, size_t n, float epsilon)
+{
+    eps::area_t area = eps::null_bounding_box();
+    size_t const lanes = 4;
+    size_t i = 0;
+    if (n >= lanes / 2)
+    {
+        __m128 const e = _mm_set1_ps(epsilon);
+        __m128 lo = _mm_set1_ps(std::numeric_limits<float>::max());
+        __m128 hi = _mm_set1_ps(std::numeric_limits<float>::lowest());
+        for (; i + lanes / 2 <= n; i += lanes / 2)
+        {
+            eps::point_t const* p = points + 3 * i;
+            curves_extremes(load_points(p - 1, p + 2), load_points(p, p + 3), load_points(p + 1, p + 4), load_points(p + 2, p + 5), e, lo, hi);
+        }
+        alignas(16) float l[lanes];
+        alignas(16) float h[lanes];
+        _mm_store_ps(l, lo);
+        _mm_store_ps(h, hi);
+        reduce_curve_lanes(l, h, lanes, area);
+    }
+    eps::area_t const rest = curves_bounding_box_scalar(points + 3 * i, n - i, epsilon);
+    eps::min_bounding_box(area.m_min, rest.m_min);
+    eps::max_bounding_box(area.m_max, rest.m_max);
+    return area;
+}
+
+// Pseudo-angle of (x, y) in [0, 4), in the same order around the origin
+// as atan2 but without trigonometry: 0, 1, 2 and 3 are the directions of
+// the axes. The origin is at 0, as atan2(0, 0) is.
+__m128 pseudo_angle(__m128 x, __m128 y)
+{
+    __m128 const sign = _mm_set1_ps(-0.f);
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const four = _mm_set1_ps(4.f);
+    __m128 const r = _mm_add_ps(_mm_andnot_ps(sign, x), _mm_andnot_ps(sign, y));
+    __m128 const q = _mm_and_ps(_mm_cmpgt_ps(r, zero), _mm_div_ps(y, r));
+    __m128 p = select(_mm_cmplt_ps(x, zero), _mm_sub_ps(_mm_set1_ps(2.f), q),
+        select(_mm_cmplt_ps(y, zero), _mm_add_ps(four, q), q));
+    return _mm_andnot_ps(_mm_cmpge_ps(p, four), p);
+}
+
+// Whether the direction with pseudo-angle theta lies on the arc from
+// pseudo-angle pa to pb, swept in the direction of sweep (+1 or -1), as
+// eps::in_arc decides it for angles.
+__m128 in_arc(float theta, __m128 pa, __m128 pb, __m128 sweep)
+{
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const four = _mm_set1_ps(4.f);
+    __m128 s = _mm_mul_ps(sweep, _mm_sub_ps(_mm_set1_ps(theta), pa));
+    __m128 e = _mm_mul_ps(sweep, _mm_sub_ps(pb, pa));
+    s = _mm_add_ps(s, _mm_and_ps(_mm_cmplt_ps(s, zero), four));
+    e = _mm_add_ps(e, _mm_and_ps(_mm_cmplt_ps(e, zero), four));
+    return _mm_cmple_ps(s, e);
+}
+
+eps::area_t arcs_bounding_box_sse2(eps::point_t const* points, size_t n, float)
+{
+    eps::area_t area = eps::null_bounding_box();
+    size_t const lanes = 4;
+    size_t i = 0;
+    __m128 const inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128 const ninf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    for (; i + lanes <= n; i += lanes)
+    {
+        alignas(16) float g[arc_coordinates * lanes];
+        gather_arcs(points + 4 * i, lanes, g);
+        auto const load = [&g](arc_coordinate_t c) { return _mm_load_ps(g + c * lanes); };
+        __m128 const ax = load(arc_ax), ay = load(arc_ay), cx = load(arc_cx), cy = load(arc_cy);
+        __m128 const rxx = load(arc_xx), rxy = load(arc_xy), ryx = load(arc_yx), ryy = load(arc_yy);
+        __m128 const bx = load(arc_bx), by = load(arc_by);
+        __m128 const xx2 = _mm_mul_ps(rxx, rxx);
+        __m128 const xy2 = _mm_mul_ps(rxy, rxy);
+        __m128 const yx2 = _mm_mul_ps(ryx, ryx);
+        __m128 const yy2 = _mm_mul_ps(ryy, ryy);
+        __m128 const ax2 = _mm_add_ps(xx2, xy2);
+        __m128 const ay2 = _mm_add_ps(yx2, yy2);
+        __m128 const dx = _mm_sqrt_ps(_mm_div_ps(_mm_add_ps(_mm_mul_ps(ax2, xx2), _mm_mul_ps(ay2, xy2)), ax2));
+        __m128 const dy = _mm_sqrt_ps(_mm_div_ps(_mm_add_ps(_mm_mul_ps(ax2, yx2), _mm_mul_ps(ay2, yy2)), ay2));
+        __m128 const positive = _mm_cmpge_ps(_mm_sub_ps(_mm_mul_ps(rxx, ryy), _mm_mul_ps(rxy, ryx)), _mm_setzero_ps());
+        __m128 const sweep = select(positive, _mm_set1_ps(1.f), _mm_set1_ps(-1.f));
+        __m128 const pa = pseudo_angle(_mm_sub_ps(ax, cx), _mm_sub_ps(ay, cy));
+        __m128 const pb = pseudo_angle(_mm_sub_ps(bx, cx), _mm_sub_ps(by, cy));
+        // 0 stands for 2 pi as well
+        __m128 const maxx = _mm_max_ps(select(in_arc(0.f, pa, pb, sweep), _mm_add_ps(cx, dx), ninf), _mm_max_ps(ax, bx));
+        __m128 const maxy = _mm_max_ps(select(in_arc(1.f, pa, pb, sweep), _mm_add_ps(cy, dy), ninf), _mm_max_ps(ay, by));
+        __m128 const minx = _mm_min_ps(select(in_arc(2.f, pa, pb, sweep), _mm_sub_ps(cx, dx), inf), _mm_min_ps(ax, bx));
+        __m128 const miny = _mm_min_ps(select(in_arc(3.f, pa, pb, sweep), _mm_sub_ps(cy, dy), inf), _mm_min_ps(ay, by));
+        alignas(16) float l[2 * lanes];
+        alignas(16) float h[2 * lanes];
+        _mm_store_ps(l, minx);
+        _mm_store_ps(l + lanes, miny);
+        _mm_store_ps(h, maxx);
+        _mm_store_ps(h + lanes, maxy);
+        reduce_arc_lanes(l, h, lanes, area);
+    }
+    eps::area_t const rest = arcs_bounding_box_scalar(points + 4 * i, n - i, 0.f);
+    eps::min_bounding_box(area.m_min, rest.m_min);
+    eps::max_bounding_box(area.m_max, rest.m_max);
+    return area;
+}
+
+#endif
+
+#ifdef EPS_AVX2
+
+EPS_TARGET_AVX2 __m256 select(__m256 mask, __m256 a, __m256 b)
+{
+    return _mm256_blendv_ps(b, a, mask);
+}
+
+// Four curves, as curves_extremes() for two.
+EPS_TARGET_AVX2 void curves_extremes(__m256 a, __m256 ai, __m256 bi, __m256 b, __m256 epsilon, __m256& lo, __m256& hi)
+{
+    __m256 const sign = _mm256_set1_ps(-0.f);
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const one = _mm256_set1_ps(1.f);
+    __m256 const two = _mm256_set1_ps(2.f);
+    __m256 const three = _mm256_set1_ps(3.f);
+    __m256 const four = _mm256_set1_ps(4.f);
+    __m256 const qa = _mm256_add_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_xor_ps(a, sign), _mm256_mul_ps(three, ai)), _mm256_mul_ps(three, bi)), b);
+    __m256 const qb = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(two, a), _mm256_mul_ps(four, ai)), _mm256_mul_ps(two, bi));
+    __m256 const qc = _mm256_sub_ps(ai, a);
+    __m256 const linear = _mm256_cmp_ps(_mm256_andnot_ps(sign, qa), epsilon, _CMP_LE_OQ);
+    __m256 const sloped = _mm256_cmp_ps(_mm256_andnot_ps(sign, qb), epsilon, _CMP_GT_OQ);
+    __m256 const tl = _mm256_and_ps(sloped, _mm256_div_ps(_mm256_xor_ps(qc, sign), qb));
+    __m256 const d = _mm256_sub_ps(_mm256_mul_ps(qb, qb), _mm256_mul_ps(_mm256_mul_ps(four, qa), qc));
+    __m256 const real = _mm256_cmp_ps(d, zero, _CMP_GE_OQ);
+    __m256 const root = _mm256_sqrt_ps(_mm256_max_ps(d, zero));
+    __m256 const nb = _mm256_xor_ps(qb, sign);
+    __m256 const twice = _mm256_mul_ps(two, qa);
+    __m256 const t[2] = {
+        select(linear, tl, _mm256_and_ps(real, _mm256_div_ps(_mm256_add_ps(nb, root), twice))),
+        select(linear, tl, _mm256_and_ps(real, _mm256_div_ps(_mm256_sub_ps(nb, root), twice)))
+    };
+    lo = _mm256_min_ps(_mm256_min_ps(a, b), lo);
+    hi = _mm256_max_ps(_mm256_max_ps(a, b), hi);
+    for (__m256 u : t)
+    {
+        u = _mm256_min_ps(_mm256_max_ps(u, zero), one);
+        __m256 const s = _mm256_sub_ps(one, u);
+        __m256 const v = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(s, s), s), a),
+            _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(three, s), s), u), ai)),
+            _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(three, s), u), u), bi)),
+            _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(u, u), u), b));
+        lo = _mm256_min_ps(v, lo);
+        hi = _mm256_max_ps(v, hi);
+    }
+}
+
+// The points of curves i and i + 2 in the low, i + 1 and i + 3 in the high
+// half; the lanes are reduced regardless of their order.
+EPS_TARGET_AVX2 __m256 load_points(eps::point_t const* p)
+{
+    __m128 const low = _mm_castpd_ps(_mm_loadh_pd(_mm_load_sd(reinterpret_cast<double const*>(p)), reinterpret_cast<double const*>(p + 6)));
+    __m128 const high = _mm_castpd_ps(_mm_loadh_pd(_mm_load_sd(reinterpret_cast<double const*>(p + 3)), reinterpret_cast<double const*>(p + 9)));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+}
+
+EPS_TARGET_AVX2 eps::area_t curves_bounding_box_avx2(eps::point_t const* points, size_t n, float epsilon)
+{
+    eps::area_t area = eps::null_bounding_box();
+    size_t const lanes = 8;
+    size_t i = 0;
+    if (n >= lanes / 2)
+    {
+        __m256 const e = _mm256_set1_ps(epsilon);
+        __m256 lo = _mm256_set1_ps(std::numeric_limits<float>::max());
+        __m256 hi = _mm256_set1_ps(std::numeric_limits<float>::lowest());
+        for (; i + lanes / 2 <= n; i += lanes / 2)
+        {
+            eps::point_t const* p = points + 3 * i;
+            curves_extremes(load_points(p - 1), load_points(p), load_points(p + 1), load_points(p + 2), e, lo, hi);
+        }
+        alignas(32) float l[lanes];
+        alignas(32) float h[lanes];
+        _mm256_store_ps(l, lo);
+        _mm256_store_ps(h, hi);
+        // the code called from here is SSE encoded, running it with dirty
+        // upper halves costs a transition on every instruction or call
+        _mm256_zeroupper();
+        reduce_curve_lanes(l, h, lanes, area);
+    }
+    eps::area_t const rest = curves_bounding_box_scalar(points + 3 * i, n - i, epsilon);
+    eps::min_bounding_box(area.m_min, rest.m_min);
+    eps::max_bounding_box(area.m_max, rest.m_max);
+    return area;
+}
+
+// As the SSE2 versions, for eight arcs.
+EPS_TARGET_AVX2 __m256 pseudo_angle(__m256 x, __m256 y)
+{
+    __m256 const sign = _mm256_set1_ps(-0.f);
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const four = _mm256_set1_ps(4.f);
+    __m256 const r = _mm256_add_ps(_mm256_andnot_ps(sign, x), _mm256_andnot_ps(sign, y));
+    __m256 const q = _mm256_and_ps(_mm256_cmp_ps(r, zero, _CMP_GT_OQ), _mm256_div_ps(y, r));
+    __m256 p = select(_mm256_cmp_ps(x, zero, _CMP_LT_OQ), _mm256_sub_ps(_mm256_set1_ps(2.f), q),
+        select(_mm256_cmp_ps(y, zero, _CMP_LT_OQ), _mm256_add_ps(four, q), q));
+    return _mm256_andnot_ps(_mm256_cmp_ps(p, four, _CMP_GE_OQ), p);
+}
+
+EPS_TARGET_AVX2 __m256 in_arc(float theta, __m256 pa, __m256 pb, __m256 sweep)
+{
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const four = _mm256_set1_ps(4.f);
+    __m256 s = _mm256_mul_ps(sweep, _mm256_sub_ps(_mm256_set1_ps(theta), pa));
+    __m256 e = _mm256_mul_ps(sweep, _mm256_sub_ps(pb, pa));
+    s = _mm256_add_ps(s, _mm256_and_ps(_mm256_cmp_ps(s, zero, _CMP_LT_OQ), four));
+    e = _mm256_add_ps(e, _mm256_and_ps(_mm256_cmp_ps(e, zero, _CMP_LT_OQ), four));
+    return _mm256_cmp_ps(s, e, _CMP_LE_OQ);
+}
+
+EPS_TARGET_AVX2 eps::area_t arcs_bounding_box_avx2(eps::point_t const* points, size_t n, float)
+{
+    eps::area_t area = eps::null_bounding_box();
+    size_t const lanes = 8;
+    size_t i = 0;
+    __m256 const inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256 const ninf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    for (; i + lanes <= n; i += lanes)
+    {
+        alignas(32) float g[arc_coordinates * lanes];
+        gather_arcs(points + 4 * i, lanes, g);
+        __m256 const ax = _mm256_load_ps(g + arc_ax * lanes), ay = _mm256_load_ps(g + arc_ay * lanes);
+        __m256 const cx = _mm256_load_ps(g + arc_cx * lanes), cy = _mm256_load_ps(g + arc_cy * lanes);
+        __m256 const rxx = _mm256_load_ps(g + arc_xx * lanes), rxy = _mm256_load_ps(g + arc_xy * lanes);
+        __m256 const ryx = _mm256_load_ps(g + arc_yx * lanes), ryy = _mm256_load_ps(g + arc_yy * lanes);
+        __m256 const bx = _mm256_load_ps(g + arc_bx * lanes), by = _mm256_load_ps(g + arc_by * lanes);
+        __m256 const xx2 = _mm256_mul_ps(rxx, rxx);
+        __m256 const xy2 = _mm256_mul_ps(rxy, rxy);
+        __m256 const yx2 = _mm256_mul_ps(ryx, ryx);
+        __m256 const yy2 = _mm256_mul_ps(ryy, ryy);
+        __m256 const ax2 = _mm256_add_ps(xx2, xy2);
+        __m256 const ay2 = _mm256_add_ps(yx2, yy2);
+        __m256 const dx = _mm256_sqrt_ps(_mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(ax2, xx2), _mm256_mul_ps(ay2, xy2)), ax2));
+        __m256 const dy = _mm256_sqrt_ps(_mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(ax2, yx2), _mm256_mul_ps(ay2, yy2)), ay2));
+        __m256 const positive = _mm256_cmp_ps(_mm256_sub_ps(_mm256_mul_ps(rxx, ryy), _mm256_mul_ps(rxy, ryx)), _mm256_setzero_ps(), _CMP_GE_OQ);
+        __m256 const sweep = select(positive, _mm256_set1_ps(1.f), _mm256_set1_ps(-1.f));
+        __m256 const pa = pseudo_angle(_mm256_sub_ps(ax, cx), _mm256_sub_ps(ay, cy));
+        __m256 const pb = pseudo_angle(_mm256_sub_ps(bx, cx), _mm256_sub_ps(by, cy));
+        __m256 const maxx = _mm256_max_ps(select(in_arc(0.f, pa, pb, sweep), _mm256_add_ps(cx, dx), ninf), _mm256_max_ps(ax, bx));
+        __m256 const maxy = _mm256_max_ps(select(in_arc(1.f, pa, pb, sweep), _mm256_add_ps(cy, dy), ninf), _mm256_max_ps(ay, by));
+        __m256 const minx = _mm256_min_ps(select(in_arc(2.f, pa, pb, sweep), _mm256_sub_ps(cx, dx), inf), _mm256_min_ps(ax, bx));
+        __m256 const miny = _mm256_min_ps(select(in_arc(3.f, pa, pb, sweep), _mm256_sub_ps(cy, dy), inf), _mm256_min_ps(ay, by));
+        alignas(32) float l[2 * lanes];
+        alignas(32) float h[2 * lanes];
+        _mm256_store_ps(l, minx);
+        _mm256_store_ps(l + lanes, miny);
+        _mm256_store_ps(h, maxx);
+        _mm256_store_ps(h + lanes, maxy);
+        _mm256_zeroupper(); // as in curves_bounding_box_avx2
+        reduce_arc_lanes(l, h, lanes, area);
+    }
+    eps::area_t const rest = arcs_bounding_box_scalar(points + 4 * i, n - i, 0.f);
+    eps::min_bounding_box(area.m_min, rest.m_min);
+    eps::max_bounding_box(area.m_max, rest.m_max);
+    return area;
+}
+
+bool has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool const avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)); // OSXSAVE and AVX
+    if (!avx || (_xgetbv(0) & 6) != 6)
+    {
+        return false; // the system does not save the registers
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+struct kernels_t
+{
+    eps::area_t (*m_curves)(eps::point_t const* points, size_t n, float epsilon);
+    eps::area_t (*m_arcs)(eps::point_t const* points, size_t n, float epsilon);
 };
 
-class closepath_t
-    : public eps::section_t
-{};
+kernels_t const& kernels()
+{
+    static kernels_t const kernels = []()
+    {
+#ifdef EPS_AVX2
+        if (has_avx2())
+        {
+            return kernels_t{ curves_bounding_box_avx2, arcs_bounding_box_avx2 };
+        }
+#endif
+#ifdef EPS_SSE2
+        return kernels_t{ curves_bounding_box_sse2, arcs_bounding_box_sse2 };
+#else
+        return kernels_t{ curves_bounding_box_scalar, arcs_bounding_box_scalar };
+#endif
+    }();
+    return kernels;
+}
 
-}; // namespace anonymous
+// Bounding box of n beziers that follow the current point points[-1].
+eps::area_t curves_bounding_box(eps::point_t const* points, size_t n, float epsilon)
+{
+    return kernels().m_curves(points, n, epsilon);
+}
 
-namespace eps
+// Bounding box of n arcs that follow the current point points[-1].
+eps::area_t arcs_bounding_box(eps::point_t const* points, size_t n, float epsilon)
 {
+    return kernels().m_arcs(points, n, epsilon);
+}
 
-path_t::path_t(iproperties_t const& parent_properties)
-    : dynamic_shape_t(parent_properties)
-    , m_fill(false)
-{}
+// Bounding box of a marker, scaled by sizes[i] (1 when sizes is null),
+// placed at every point, in one pass over the points.
+eps::area_t markers_bounding_box(eps::point_t const* points, float const* sizes, size_t n, eps::area_t marker)
+{
+    float minx = std::numeric_limits<float>::max();
+    float miny = std::numeric_limits<float>::max();
+    float maxx = std::numeric_limits<float>::lowest();
+    float maxy = std::numeric_limits<float>::lowest();
+    size_t i = 0;
+#ifdef EPS_SSE2
+    // two points (x y x y) per register
+    __m128 lo = _mm_set_ps(miny, minx, miny, minx);
+    __m128 hi = _mm_set_ps(maxy, maxx, maxy, maxx);
+    __m128 const mmin = _mm_set_ps(marker.m_min.m_y, marker.m_min.m_x, marker.m_min.m_y, marker.m_min.m_x);
+    __m128 const mmax = _mm_set_ps(marker.m_max.m_y, marker.m_max.m_x, marker.m_max.m_y, marker.m_max.m_x);
+    __m128 s = _mm_set1_ps(1.f);
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128 p = _mm_loadu_ps(&points[i].m_x);
+        if (sizes)
+        {
+            __m128 s2 = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<double const*>(sizes + i)));
+            s = _mm_unpacklo_ps(s2, s2);
+        }
+        __m128 a = _mm_add_ps(p, _mm_mul_ps(s, mmin));
+        __m128 b = _mm_add_ps(p, _mm_mul_ps(s, mmax));
+        lo = _mm_min_ps(lo, _mm_min_ps(a, b));
+        hi = _mm_max_ps(hi, _mm_max_ps(a, b));
+    }
+    alignas(16) float l[4];
+    alignas(16) float h[4];
+    _mm_store_ps(l, lo);
+    _mm_store_ps(h, hi);
+    minx = std::min(l[0], l[2]);
+    miny = std::min(l[1], l[3]);
+    maxx = std::max(h[0], h[2]);
+    maxy = std::max(h[1], h[3]);
+#endif
+    for (; i < n; ++i)
+    {
+        float s = sizes ? sizes[i] : 1.f;
+        float ax = points[i].m_x + s * marker.m_min.m_x;
+        float bx = points[i].m_x + s * marker.m_max.m_x;
+        float ay = points[i].m_y + s * marker.m_min.m_y;
+        float by = points[i].m_y + s * marker.m_max.m_y;
+        minx = std::min(minx, std::min(ax, bx));
+        maxx = std::max(maxx, std::max(ax, bx));
+        miny = std::min(miny, std::min(ay, by));
+        maxy = std::max(maxy, std::max(ay, by));
+    }
+    return eps::area_t(eps::point_t(minx, miny), eps::point_t(maxx, maxy));
+}
 
-path_t::path_t(path_t const& rhs)
-    : dynamic_shape_t(rhs)
-    , m_fill(rhs.m_fill)
+// ASCII85 encoder that writes straight from the caller's bytes to the stream
+// through a fixed output buffer. Input is taken in blocks of 48 groups of 4
+// bytes; a block becomes one output line of at most 240 characters.
+class ascii85_writer_t
 {
-    m_sections.reserve(rhs.m_sections.size());
-    std::transform(rhs.m_sections.begin(), rhs.m_sections.end(), std::back_inserter(m_sections), 
-        [](const std::unique_ptr<section_t>& section) -> std::unique_ptr<section_t>
+public:
+    explicit ascii85_writer_t(std::ostream& stream)
+        : m_stream(stream)
+        , m_fill(0)
+        , m_out_size(0)
+    {}
+    void write(uint8_t const* data, size_t n)
     {
-        if (beginpoint_t* s = dynamic_cast<beginpoint_t*>(&*section))
+        if (m_fill)
         {
-            return std::make_unique<beginpoint_t>(*s);
+            size_t take = std::min(n, block_size - m_fill);
+            std::copy(data, data + take, m_block + m_fill);
+            m_fill += take;
+            data += take;
+            n -= take;
+            if (m_fill < block_size)
+            {
+                return;
+            }
+            encode_block(m_block, block_groups);
+            m_fill = 0;
         }
-        else if (linesection_t* s = dynamic_cast<linesection_t*>(&*section))
+        for (; n >= block_size; data += block_size, n -= block_size)
         {
-            return std::make_unique<linesection_t>(*s);
+            encode_block(data, block_groups);
         }
-        else if (beziersection_t* s = dynamic_cast<beziersection_t*>(&*section))
+        std::copy(data, data + n, m_block);
+        m_fill = n;
+    }
+    void close()
+    {
+        size_t groups = m_fill / 4;
+        size_t rest = m_fill % 4;
+        if (groups)
+        {
+            encode_block(m_block, groups);
+        }
+        if (rest)
+        {
+            uint8_t last[4] = { 0, 0, 0, 0 };
+            std::copy(m_block + 4 * groups, m_block + m_fill, last);
+            char digits[5];
+            encode_digits(be32(last), digits);
+            reserve(rest + 1);
+            std::copy(digits, digits + rest + 1, m_out + m_out_size);
+            m_out_size += rest + 1;
+        }
+        reserve(3);
+        m_out[m_out_size++] = '~';
+        m_out[m_out_size++] = '>';
+        m_out[m_out_size++] = '\n';
+        flush();
+    }
+private:
+    static size_t const block_groups = 48;
+    static size_t const block_size = 4 * block_groups;
+    static size_t const out_size = 1 << 16;
+
+    static uint32_t be32(uint8_t const* p)
+    {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+    static void encode_digits(uint32_t v, char* digits)
+    {
+        for (int i = 4; i >= 0; --i)
+        {
+            digits[i] = static_cast<char>('!' + v % 85);
+            v /= 85;
+        }
+    }
+    // The digits of a whole block are computed in straight loops without
+    // branches so that the divisions by 85 vectorize; only the 'z' special
+    // case for zero groups is handled while copying them out.
+    void encode_block(uint8_t const* data, size_t groups)
+    {
+        uint32_t v[block_groups];
+        uint8_t d[5][block_groups];
+        for (size_t g = 0; g < groups; ++g)
+        {
+            v[g] = be32(data + 4 * g);
+        }
+        for (size_t g = 0; g < groups; ++g)
+        {
+            uint32_t x = v[g];
+            d[4][g] = static_cast<uint8_t>(x % 85); x /= 85;
+            d[3][g] = static_cast<uint8_t>(x % 85); x /= 85;
+            d[2][g] = static_cast<uint8_t>(x % 85); x /= 85;
+            d[1][g] = static_cast<uint8_t>(x % 85); x /= 85;
+            d[0][g] = static_cast<uint8_t>(x);
+        }
+        reserve(5 * groups + 1);
+        char* out = m_out + m_out_size;
+        for (size_t g = 0; g < groups; ++g)
+        {
+            if (v[g] == 0)
+            {
+                *out++ = 'z';
+                continue;
+            }
+            for (int i = 0; i < 5; ++i)
+            {
+                *out++ = static_cast<char>('!' + d[i][g]);
+            }
+        }
+        *out++ = '\n';
+        m_out_size = out - m_out;
+    }
+    void reserve(size_t n)
+    {
+        if (m_out_size + n > out_size)
+        {
+            flush();
+        }
+    }
+    void flush()
+    {
+        m_stream.write(m_out, m_out_size);
+        m_out_size = 0;
+    }
+    std::ostream& m_stream;
+    uint8_t m_block[block_size];
+    size_t m_fill;
+    char m_out[out_size];
+    size_t m_out_size;
+};
+
+// PostScript RunLength encoder in front of an ascii85_writer_t. Runs do not
+// continue across write() calls.
+class runlength_writer_t
+{
+public:
+    explicit runlength_writer_t(ascii85_writer_t& out)
+        : m_out(out)
+        , m_size(0)
+    {}
+    void write(uint8_t const* data, size_t n)
+    {
+        size_t i = 0;
+        while (i < n)
+        {
+            size_t j = i + 1;
+            while (j < n && j - i < 128 && data[j] == data[i])
+            {
+                ++j;
+            }
+            if (j - i >= 2)
+            {
+                put(static_cast<uint8_t>(257 - (j - i)), data + i, 1);
+                i = j;
+                continue;
+            }
+            for (j = i + 1; j < n && j - i < 128; ++j)
+            {
+                if (j + 2 < n && data[j] == data[j + 1] && data[j] == data[j + 2])
+                {
+                    break;
+                }
+            }
+            put(static_cast<uint8_t>(j - i - 1), data + i, j - i);
+            i = j;
+        }
+    }
+    void close()
+    {
+        uint8_t const eod = 128;
+        put(eod, nullptr, 0);
+        m_out.write(m_buffer, m_size);
+        m_size = 0;
+    }
+private:
+    void put(uint8_t length, uint8_t const* data, size_t n)
+    {
+        if (m_size + 1 + n > sizeof(m_buffer))
         {
-            return std::make_unique<beziersection_t>(*s);
+            m_out.write(m_buffer, m_size);
+            m_size = 0;
         }
-        else if (arcsection_t* s = dynamic_cast<arcsection_t*>(&*section))
+        m_buffer[m_size++] = length;
+        std::copy(data, data + n, m_buffer + m_size);
+        m_size += n;
+    }
+    ascii85_writer_t& m_out;
+    uint8_t m_buffer[1 << 14];
+    size_t m_size;
+};
+
+bool contains(eps::area_t const& outer, eps::area_t const& inner)
+{
+    return outer.m_min.m_x <= inner.m_min.m_x && inner.m_max.m_x <= outer.m_max.m_x &&
+        outer.m_min.m_y <= inner.m_min.m_y && inner.m_max.m_y <= outer.m_max.m_y;
+}
+
+// Clips the segment to the area (Liang-Barsky); false if nothing is left.
+bool clip_line(eps::point_t& a, eps::point_t& b, eps::area_t const& area)
+{
+    float const dx = b.m_x - a.m_x;
+    float const dy = b.m_y - a.m_y;
+    float t0 = 0;
+    float t1 = 1;
+    auto edge = [&t0, &t1](float p, float q)
+    {
+        if (p == 0)
         {
-            return std::make_unique<arcsection_t>(*s);
+            return q >= 0;
         }
-        else if (closepath_t* s = dynamic_cast<closepath_t*>(&*section))
+        float const r = q / p;
+        if (p < 0)
         {
-            return std::make_unique<closepath_t>(*s);
+            if (r > t1) return false;
+            t0 = std::max(t0, r);
         }
         else
         {
-            THROW(std::logic_error, "E0101", << "Unsupported closepath_t type");
+            if (r < t0) return false;
+            t1 = std::min(t1, r);
         }
-    });
+        return true;
+    };
+    if (!edge(-dx, a.m_x - area.m_min.m_x) || !edge(dx, area.m_max.m_x - a.m_x) ||
+        !edge(-dy, a.m_y - area.m_min.m_y) || !edge(dy, area.m_max.m_y - a.m_y))
+    {
+        return false;
+    }
+    eps::point_t const a0 = a;
+    if (t1 < 1)
+    {
+        b = eps::point_t(a0.m_x + t1 * dx, a0.m_y + t1 * dy);
+    }
+    if (t0 > 0)
+    {
+        a = eps::point_t(a0.m_x + t0 * dx, a0.m_y + t0 * dy);
+    }
+    return true;
 }
 
-void path_t::draw(std::ostream& stream, graphicsstate_t& graphicsstate) const
+// Writes the sections of a path cut to an area, for stroking. Only the
+// visible pieces are written, each starting with its own moveto; a section
+// that is not cut keeps its closepath. Visible runs of lines still go
+// through eps::polyline. Beziers are split at t = 1/2 until their control
+// polygon is either inside or outside the area; arcs are written whole if
+// they are partly visible, the clip path takes care of the rest.
+class clipper_t
 {
-    new_path(stream);
-    for (std::unique_ptr<section_t> const& s : m_sections)
+public:
+    clipper_t(std::ostream& stream, eps::area_t const& area, float epsilon, float simplify_epsilon, bool simplify)
+        : m_stream(stream)
+        , m_area(area)
+        , m_epsilon(epsilon)
+        , m_simplify_epsilon(simplify_epsilon)
+        , m_simplify(simplify)
+        , m_pen(false)
+        , m_cut(false)
+        , m_exact(false)
+    {}
+    void moveto(eps::point_t p)
+    {
+        flush();
+        m_current = m_start = p;
+        m_pen = false;
+        m_cut = false;
+    }
+    void lineto(eps::point_t b)
     {
-        if (beginpoint_t const* p = dynamic_cast<beginpoint_t const*>(s.get()))
+        eps::point_t a = m_current;
+        m_current = b;
+        if (!clip_line(a, b, m_area))
         {
-            eps::moveto(stream, m_[p->m_a]);
+            m_cut = true;
+            return;
         }
-        else if (linesection_t const* p = dynamic_cast<linesection_t const*>(s.get()))
+        if (!m_pen || a != m_run.back())
         {
-            eps::lineto(stream, m_[p->m_b]);
+            penup(a);
         }
-        else if (beziersection_t const* p = dynamic_cast<beziersection_t const*>(s.get()))
+        m_run.push_back(b);
+        m_cut = m_cut || b != m_current;
+    }
+    void curveto(eps::point_t ai, eps::point_t bi, eps::point_t b)
+    {
+        eps::point_t const a = m_current;
+        m_current = b;
+        bezier(a, ai, bi, b, 0);
+    }
+    void arcto(eps::point_t c, eps::vect_t rx, eps::vect_t ry, eps::point_t b)
+    {
+        eps::point_t const a = m_current;
+        m_current = b;
+        eps::area_t const area = eps::arc_bounding_box(a, c, rx, ry, b, m_epsilon);
+        if (!intersects(area))
         {
-            eps::curveto(stream, m_[p->m_ai], m_[p->m_bi], m_[p->m_b]);
+            m_cut = true;
+            return;
         }
-        else if (arcsection_t const* p = dynamic_cast<arcsection_t const*>(s.get()))
+        pendown(a);
+        eps::draw_arc(m_stream, a, c, rx, ry, b, m_epsilon);
+        m_run.assign(1, b);
+        m_exact = false;
+    }
+    void closepath()
+    {
+        if (m_pen && !m_cut)
         {
-            eps::draw_arc(stream, m_[p->m_a], m_[p->m_c], m_[p->m_ax] - m_[p->m_c], m_[p->m_ay] - m_[p->m_c], m_[p->m_b], get_epsilon(graphicsstate));
+            flush();
+            eps::closepath(m_stream);
+            m_run.assign(1, m_start);
+            m_current = m_start;
+            m_exact = true;
+            return;
         }
-        else if (closepath_t const* p = dynamic_cast<closepath_t const*>(s.get()))
+        lineto(m_start);
+    }
+    void flush()
+    {
+        if (m_run.size() > 1)
         {
-            eps::closepath(stream);
+            eps::point_t const* run = m_run.data();
+            size_t n = m_run.size();
+            if (!m_exact)
+            {
+                eps::lineto(m_stream, run[1]);
+                m_exact = true;
+                ++run;
+                --n;
+            }
+            if (n > 1)
+            {
+                eps::polyline(m_stream, run, n, eps::point_t(0.f, 0.f), m_simplify_epsilon, m_simplify);
+            }
+            m_run.erase(m_run.begin(), m_run.end() - 1);
+        }
+    }
+private:
+    // Starts a new visible piece at p.
+    void penup(eps::point_t p)
+    {
+        flush();
+        m_cut = m_cut || p != m_start || m_pen;
+        eps::moveto(m_stream, p);
+        m_run.assign(1, p);
+        m_pen = true;
+        m_exact = true;
+    }
+    // Makes sure the current point is p, for a segment written as is.
+    void pendown(eps::point_t p)
+    {
+        if (!m_pen || p != m_run.back())
+        {
+            penup(p);
         }
         else
         {
-            THROW(std::logic_error, "E0101", << "Unsupported closepath_t type");
+            flush();
+        }
+    }
+    bool intersects(eps::area_t const& a) const
+    {
+        return a.m_min.m_x <= m_area.m_max.m_x && m_area.m_min.m_x <= a.m_max.m_x &&
+            a.m_min.m_y <= m_area.m_max.m_y && m_area.m_min.m_y <= a.m_max.m_y;
+    }
+    void bezier(eps::point_t a, eps::point_t ai, eps::point_t bi, eps::point_t b, int depth)
+    {
+        int const max_depth = 8;
+        eps::area_t hull(a, a);
+        for (eps::point_t p : { ai, bi, b })
+        {
+            eps::min_bounding_box(hull.m_min, p);
+            eps::max_bounding_box(hull.m_max, p);
         }
+        if (!intersects(hull))
+        {
+            m_cut = true;
+            return;
+        }
+        if (depth == max_depth || contains(m_area, hull))
+        {
+            pendown(a);
+            if (m_exact)
+            {
+                eps::curveto(m_stream, a, ai, bi, b);
+            }
+            else
+            {
+                eps::curveto(m_stream, ai, bi, b);
+            }
+            m_run.assign(1, b);
+            m_exact = true;
+            return;
+        }
+        // de Casteljau at t = 1/2
+        auto mid = [](eps::point_t p, eps::point_t q) { return eps::point_t((p.m_x + q.m_x) / 2, (p.m_y + q.m_y) / 2); };
+        eps::point_t const ab = mid(a, ai);
+        eps::point_t const bc = mid(ai, bi);
+        eps::point_t const cd = mid(bi, b);
+        eps::point_t const abc = mid(ab, bc);
+        eps::point_t const bcd = mid(bc, cd);
+        eps::point_t const m = mid(abc, bcd);
+        bezier(a, ab, abc, m, depth + 1);
+        bezier(m, bcd, cd, b, depth + 1);
+    }
+    std::ostream& m_stream;
+    eps::area_t m_area;
+    float m_epsilon;
+    float m_simplify_epsilon;
+    bool m_simplify;
+    eps::point_t m_current; // where the path is, visible or not
+    eps::point_t m_start;   // of the section
+    std::vector<eps::point_t> m_run; // written from m_run[0], the current point when m_pen
+    bool m_pen;             // a visible piece was started in this section
+    bool m_cut;             // the section is not written as a whole
+    bool m_exact;           // m_run[0] is the current point as written
+};
+
+}; // namespace anonymous
+
+namespace eps
+{
+
+path_t::path_t(iproperties_t const& parent_properties)
+    : dynamic_shape_t(parent_properties)
+    , m_ops(resource())
+    , m_fill(false)
+    , m_simplify(false)
+{}
+
+path_t::path_t(path_t const& rhs)
+    : dynamic_shape_t(rhs)
+    , m_ops(rhs.m_ops, resource())
+    , m_fill(rhs.m_fill)
+    , m_simplify(rhs.m_simplify)
+{}
+
+// A stroked path that crosses the viewport of the stream is cut to it,
+// widened by the extent of the line width, joins and caps. Filled paths
+// are left to the clip path, and so are dashed ones: every cut piece is a
+// subpath of its own, which would restart the dash pattern.
+void path_t::draw(std::ostream& stream, graphicsstate_t& graphicsstate) const
+{
+    new_path(stream);
+    float const epsilon = get_epsilon(graphicsstate);
+    area_t const* area = viewport(stream);
+    if (!area || m_fill || linestyle() != linestyle_none() || (is_bounding_box_valid(epsilon) && contains(*area, m_bounding_box)))
+    {
+        draw_sections(stream, point_t(0.f, 0.f), epsilon);
+    }
+    else
+    {
+        float const margin = stroke_margin(*this) + epsilon;
+        draw_clipped_sections(stream, area_t(
+            point_t(area->m_min.m_x - margin, area->m_min.m_y - margin),
+            point_t(area->m_max.m_x + margin, area->m_max.m_y + margin)), epsilon);
+    }
+    paint(stream, graphicsstate);
+}
+
+bool path_t::releasable(std::pmr::memory_resource const* resource) const
+{
+    return m_.get_allocator().resource() == resource && m_ops.get_allocator().resource() == resource;
+}
+
+bool path_t::draw_geometry(std::ostream& stream, point_t& origin, float epsilon) const
+{
+    if (m_.empty())
+    {
+        return false;
     }
+    origin = m_.front();
+    draw_sections(stream, origin, epsilon);
+    return true;
+}
+
+void path_t::paint(std::ostream& stream, graphicsstate_t& graphicsstate) const
+{
     if (m_fill)
     {
         eps::fill(stream, graphicsstate, *this, true);
@@ -134,78 +1076,784 @@ void path_t::draw(std::ostream& stream, graphicsstate_t& graphicsstate) const
     }
 }
 
+// Draws the sections relative to origin
+void path_t::draw_sections(std::ostream& stream, point_t origin, float epsilon) const
+{
+    auto at = [origin](point_t p) { return point_t(p.m_x - origin.m_x, p.m_y - origin.m_y); };
+    // Whether p[-1] is the current point as written, segments can only be
+    // written relative to it then. Arcs end where PostScript computes it.
+    point_t const* p = m_.data();
+    point_t const* start = p;
+    bool exact = false;
+    auto lines = [&](size_t n)
+    {
+        if (!exact)
+        {
+            eps::lineto(stream, at(p[0]));
+            p += 1;
+            n -= 1;
+        }
+        if (n)
+        {
+            eps::polyline(stream, p - 1, n + 1, origin, this->epsilon(), m_simplify);
+            p += n;
+        }
+        exact = true;
+    };
+    auto curve = [&]()
+    {
+        check_current_point(p, m_.data());
+        if (exact)
+        {
+            eps::curveto(stream, at(p[-1]), at(p[0]), at(p[1]), at(p[2]));
+        }
+        else
+        {
+            eps::curveto(stream, at(p[0]), at(p[1]), at(p[2]));
+        }
+        p += 3;
+        exact = true;
+    };
+    for (size_t i = 0; i < m_ops.size(); ++i)
+    {
+        switch (m_ops[i])
+        {
+        case op_moveto:
+            eps::moveto(stream, at(p[0]));
+            start = p;
+            p += 1;
+            exact = true;
+            break;
+        case op_lineto:
+        {
+            size_t n = 1;
+            while (i + n < m_ops.size() && m_ops[i + n] == op_lineto)
+            {
+                ++n;
+            }
+            lines(n);
+            i += n - 1;
+            break;
+        }
+        case op_lines:
+            lines(count_at(&m_ops[i + 1]));
+            i += count_size;
+            break;
+        case op_curveto:
+            curve();
+            break;
+        case op_curves:
+        {
+            size_t const n = count_at(&m_ops[i + 1]);
+            for (size_t k = 0; k < n; ++k)
+            {
+                curve();
+            }
+            i += count_size;
+            break;
+        }
+        case op_arcto:
+            check_current_point(p, m_.data());
+            eps::draw_arc(stream, at(p[-1]), at(p[0]), p[1] - p[0], p[2] - p[0], at(p[3]), epsilon);
+            p += 4;
+            exact = false;
+            break;
+        case op_closepath:
+            eps::closepath(stream);
+            exact = exact && p != m_.data() && p[-1] == *start;
+            break;
+        default:
+            THROW(std::logic_error, "E0101", << "Unsupported section type");
+        }
+    }
+}
+
+void path_t::draw_clipped_sections(std::ostream& stream, area_t const& area, float epsilon) const
+{
+    clipper_t clipper(stream, area, epsilon, this->epsilon(), m_simplify);
+    point_t const* p = m_.data();
+    for (size_t i = 0; i < m_ops.size(); ++i)
+    {
+        switch (m_ops[i])
+        {
+        case op_moveto:
+            clipper.moveto(p[0]);
+            p += 1;
+            break;
+        case op_lineto:
+            if (p == m_.data())
+            {
+                clipper.moveto(p[0]);
+            }
+            else
+            {
+                clipper.lineto(p[0]);
+            }
+            p += 1;
+            break;
+        case op_lines:
+        {
+            size_t const n = count_at(&m_ops[i + 1]);
+            for (size_t k = 0; k < n; ++k, p += 1)
+            {
+                clipper.lineto(p[0]);
+            }
+            i += count_size;
+            break;
+        }
+        case op_curveto:
+            check_current_point(p, m_.data());
+            clipper.curveto(p[0], p[1], p[2]);
+            p += 3;
+            break;
+        case op_curves:
+        {
+            size_t const n = count_at(&m_ops[i + 1]);
+            check_current_point(p, m_.data());
+            for (size_t k = 0; k < n; ++k, p += 3)
+            {
+                clipper.curveto(p[0], p[1], p[2]);
+            }
+            i += count_size;
+            break;
+        }
+        case op_arcto:
+            check_current_point(p, m_.data());
+            clipper.arcto(p[0], p[1] - p[0], p[2] - p[0], p[3]);
+            p += 4;
+            break;
+        case op_closepath:
+            clipper.closepath();
+            break;
+        default:
+            THROW(std::logic_error, "E0101", << "Unsupported section type");
+        }
+    }
+    clipper.flush();
+}
+
 area_t path_t::bounding_box(float epsilon)
 {
+    if (is_bounding_box_valid(epsilon))
+    {
+        return m_bounding_box;
+    }
     area_t area = null_bounding_box();
-    for (std::unique_ptr<section_t> const& s : m_sections)
+    point_t const* p = m_.data();
+    for (size_t i = 0; i < m_ops.size(); ++i)
     {
-        if (beginpoint_t const* p = dynamic_cast<beginpoint_t const*>(s.get()))
+        switch (m_ops[i])
+        {
+        case op_moveto:
+        case op_lineto:
+            min_bounding_box(area.m_min, p[0]);
+            max_bounding_box(area.m_max, p[0]);
+            p += 1;
+            break;
+        case op_lines:
         {
-            min_bounding_box(area.m_min, m_[p->m_a]);
-            max_bounding_box(area.m_max, m_[p->m_a]);
+            size_t const n = count_at(&m_ops[i + 1]);
+            area_t bb = points_bounding_box(p, n);
+            min_bounding_box(area.m_min, bb.m_min);
+            max_bounding_box(area.m_max, bb.m_max);
+            p += n;
+            i += count_size;
+            break;
         }
-        else if (linesection_t const* p = dynamic_cast<linesection_t const*>(s.get()))
+        case op_curveto:
         {
-            min_bounding_box(area.m_min, m_[p->m_b]);
-            max_bounding_box(area.m_max, m_[p->m_b]);
+            // a run of single curves is as contiguous as op_curves
+            size_t n = 1;
+            while (i + n < m_ops.size() && m_ops[i + n] == op_curveto)
+            {
+                ++n;
+            }
+            area_t bb = curves_bounding_box(p, n, epsilon);
+            min_bounding_box(area.m_min, bb.m_min);
+            max_bounding_box(area.m_max, bb.m_max);
+            p += 3 * n;
+            i += n - 1;
+            break;
         }
-        else if (beziersection_t const* p = dynamic_cast<beziersection_t const*>(s.get()))
+        case op_curves:
         {
-            area_t bb = bezier_bounding_box(m_[p->m_a], m_[p->m_ai], m_[p->m_bi], m_[p->m_b], epsilon);
+            size_t const n = count_at(&m_ops[i + 1]);
+            area_t bb = curves_bounding_box(p, n, epsilon);
             min_bounding_box(area.m_min, bb.m_min);
             max_bounding_box(area.m_max, bb.m_max);
+            p += 3 * n;
+            i += count_size;
+            break;
         }
-        else if (arcsection_t const* p = dynamic_cast<arcsection_t const*>(s.get()))
+        case op_arcto:
         {
-            area_t bb = arc_bounding_box(m_[p->m_a], m_[p->m_c], m_[p->m_ax] - m_[p->m_c], m_[p->m_ay] - m_[p->m_c], m_[p->m_b], epsilon);
+            size_t n = 1;
+            while (i + n < m_ops.size() && m_ops[i + n] == op_arcto)
+            {
+                ++n;
+            }
+            area_t bb = arcs_bounding_box(p, n, epsilon);
             min_bounding_box(area.m_min, bb.m_min);
             max_bounding_box(area.m_max, bb.m_max);
+            p += 4 * n;
+            i += n - 1;
+            break;
+        }
+        default:
+            break;
         }
     }
+    cache_bounding_box(area, epsilon);
     return area;
 }
 
+void path_t::apply(transformation_t const& t, bool excluding_text)
+{
+    dynamic_shape_t::apply(t, excluding_text);
+    apply_bounding_box(t);
+}
+
+// Runs of lineto sections are simplified within the epsilon property when
+// they are drawn, see eps::polyline.
+void path_t::setsimplify(bool simplify)
+{
+    m_simplify = simplify;
+    invalidate_emission();
+}
+
 void path_t::moveto(point_t p)
 {
     m_.emplace_back(p);
-    m_sections.emplace_back(std::make_unique<beginpoint_t>(static_cast<int>(m_.size()) - 1));
+    m_ops.push_back(op_moveto);
+    extend_bounding_box(area_t(p, p));
 }
 
 void path_t::lineto(point_t p)
 {
     m_.emplace_back(p);
-    m_sections.emplace_back(std::make_unique<linesection_t>(static_cast<int>(m_.size())-1));
+    m_ops.push_back(op_lineto);
+    extend_bounding_box(area_t(p, p));
 }
 
 void path_t::curveto(point_t tangent1, point_t tangent2, point_t end)
 {
+    check_current_point(m_.data() + m_.size(), m_.data());
     m_.emplace_back(tangent1);
     m_.emplace_back(tangent2);
     m_.emplace_back(end);
-    m_sections.emplace_back(std::make_unique<beziersection_t>(
-		static_cast<int>(m_.size()) - 4, 
-		static_cast<int>(m_.size()) - 3, 
-		static_cast<int>(m_.size()) - 2, 
-		static_cast<int>(m_.size()) - 1));
+    m_ops.push_back(op_curveto);
+    if (is_bounding_box_cached())
+    {
+        point_t const* p = &m_.back() - 2;
+        extend_bounding_box(bezier_bounding_box(p[-1], p[0], p[1], p[2], m_bounding_box_epsilon));
+    }
 }
 
 void path_t::arcto(point_t center, point_t x_ax, point_t y_ax, point_t end)
 {
+    check_current_point(m_.data() + m_.size(), m_.data());
     m_.emplace_back(center);
     m_.emplace_back(x_ax);
     m_.emplace_back(y_ax);
     m_.emplace_back(end);
-    m_sections.emplace_back(std::make_unique<arcsection_t>(
-		static_cast<int>(m_.size()) - 5, 
-		static_cast<int>(m_.size()) - 4, 
-		static_cast<int>(m_.size()) - 3, 
-		static_cast<int>(m_.size()) - 2, 
-		static_cast<int>(m_.size()) - 1));
+    m_ops.push_back(op_arcto);
+    if (is_bounding_box_cached())
+    {
+        point_t const* p = &m_.back() - 3;
+        extend_bounding_box(arc_bounding_box(p[-1], p[0], p[1] - p[0], p[2] - p[0], p[3], m_bounding_box_epsilon));
+    }
 }
 
 void path_t::closepath()
 {
-    m_sections.emplace_back(std::make_unique<closepath_t>());
+    m_ops.push_back(op_closepath);
+    invalidate_emission();
+}
+
+// The bulk versions add a subpath through all points as one section, with
+// the points reserved at once.
+void path_t::polyline(point_t const* points, size_t n)
+{
+    if (!n)
+    {
+        return;
+    }
+    m_.insert(m_.end(), points, points + n);
+    add_lines(n);
+}
+
+// Adopts the storage of points if the path is still empty and the vector
+// uses the same memory resource as the path, see resource().
+void path_t::polyline(std::pmr::vector<point_t>&& points)
+{
+    if (!m_.empty())
+    {
+        polyline(points.data(), points.size());
+        return;
+    }
+    size_t const n = points.size();
+    if (!n)
+    {
+        return;
+    }
+    m_ = std::move(points);
+    add_lines(n);
+}
+
+void path_t::polygon(point_t const* points, size_t n)
+{
+    polyline(points, n);
+    closepath();
+}
+
+void path_t::polygon(std::pmr::vector<point_t>&& points)
+{
+    polyline(std::move(points));
+    closepath();
+}
+
+// points[0] is the begin point, each following three points are the
+// tangents and the end point of a bezier.
+void path_t::bezier_chain(point_t const* points, size_t n)
+{
+    if (!n)
+    {
+        return;
+    }
+    if ((n - 1) % 3)
+    {
+        THROW(std::invalid_argument, "E0105", << "A bezier chain needs 1 + 3k points, got " << n);
+    }
+    m_.insert(m_.end(), points, points + n);
+    m_ops.push_back(op_moveto);
+    if (n > 1)
+    {
+        m_ops.push_back(op_curves);
+        push_count(m_ops, (n - 1) / 3);
+    }
+    if (is_bounding_box_cached())
+    {
+        point_t const* p = &m_.back() - (n - 1);
+        area_t area = curves_bounding_box(p + 1, (n - 1) / 3, m_bounding_box_epsilon);
+        min_bounding_box(area.m_min, p[0]);
+        max_bounding_box(area.m_max, p[0]);
+        extend_bounding_box(area);
+    }
+    else
+    {
+        shape_changed();
+    }
+}
+
+// Records the last n points as moveto and one op_lines section.
+void path_t::add_lines(size_t n)
+{
+    m_ops.push_back(op_moveto);
+    if (n > 1)
+    {
+        m_ops.push_back(op_lines);
+        push_count(m_ops, n - 1);
+    }
+    extend_bounding_box(points_bounding_box(&m_.back() - (n - 1), n));
+}
+
+markers_t::markers_t(iproperties_t const& parent_properties)
+    : shape_t(parent_properties)
+    , m_marker(std::make_unique<path_t>(*this))
+    , m_fill(false)
+{}
+
+path_t& markers_t::marker()
+{
+    invalidate_bounding_box();
+    return *m_marker;
+}
+
+void markers_t::setpoints(std::vector<point_t> points)
+{
+    m_points = std::move(points);
+    invalidate_bounding_box();
+}
+
+void markers_t::setsizes(std::vector<float> sizes)
+{
+    m_sizes = std::move(sizes);
+    invalidate_bounding_box();
+}
+
+void markers_t::setcolors(std::vector<uint8_t> color_indices, std::vector<float> palette)
+{
+    m_color_indices = std::move(color_indices);
+    m_palette = std::move(palette);
+    invalidate_emission();
+}
+
+void markers_t::setfill(bool fill)
+{
+    m_fill = fill;
+    invalidate_emission();
+}
+
+// The points, with their size and color index, are written once as arrays of
+// at most 65535 elements (the PostScript array limit) and a for loop runs the
+// marker procedure over each of them:
+//   /_mN { <marker> } bind def
+//   /_mNl { _mNd exch stride getinterval aload pop ... _mN setmatrix stroke } bind def
+//   /_mNd [ x y s c ... ] def
+//   0 stride _mNd length 1 sub /_mNl load for
+void markers_t::draw(std::ostream& stream, graphicsstate_t& graphicsstate) const
+{
+    if (m_points.empty())
+    {
+        return;
+    }
+    bool const sizes = m_sizes.size() == m_points.size();
+    bool const colors = m_color_indices.size() == m_points.size() && !m_palette.empty();
+    size_t const stride = 2 + sizes + colors;
+    size_t const chunk = 65535 / stride;
+    std::string const name = unique_name(stream, "_m");
+
+    graphicsstate_t const saved = graphicsstate;
+    gsave(stream);
+    if (m_fill)
+    {
+        setfillstate(stream, graphicsstate, *this);
+    }
+    else
+    {
+        setstrokestate(stream, graphicsstate, *this);
+    }
+    stream << '/' << name << " {\n";
+    m_marker->draw_sections(stream, point_t(0.f, 0.f), get_epsilon(graphicsstate));
+    stream << "} bind def\n";
+    if (colors)
+    {
+        stream << '/' << name << "c [\n";
+        for (size_t i = 0; i + 3 <= m_palette.size(); i += 3)
+        {
+            stream << '[';
+            write_number(stream, m_palette[i]);
+            stream << ' ';
+            write_number(stream, m_palette[i + 1]);
+            stream << ' ';
+            write_number(stream, m_palette[i + 2]);
+            stream << "]\n";
+        }
+        stream << "] def\n";
+    }
+    stream << '/' << name << "l { " << name << "d exch " << stride << " getinterval aload pop ";
+    if (colors)
+    {
+        stream << name << "c exch get aload pop setrgbcolor ";
+    }
+    if (sizes)
+    {
+        stream << "matrix currentmatrix 4 1 roll 3 1 roll translate dup scale ";
+    }
+    else
+    {
+        stream << "matrix currentmatrix 3 1 roll translate ";
+    }
+    stream << "newpath " << name << " setmatrix " << (m_fill ? "fill" : "stroke") << " } bind def\n";
+    for (size_t begin = 0; begin < m_points.size(); begin += chunk)
+    {
+        size_t const end = std::min(m_points.size(), begin + chunk);
+        stream << '/' << name << "d [\n";
+        for (size_t i = begin; i < end; ++i)
+        {
+            stream << m_points[i];
+            if (sizes)
+            {
+                stream << ' ';
+                write_number(stream, m_sizes[i]);
+            }
+            if (colors)
+            {
+                stream << ' ' << static_cast<int>(m_color_indices[i]);
+            }
+            stream << ((i - begin) % 8 == 7 ? '\n' : ' ');
+        }
+        stream << "\n] def\n";
+        stream << "0 " << stride << ' ' << name << "d length 1 sub /" << name << "l load for\n";
+    }
+    grestore(stream);
+    graphicsstate = saved;
+}
+
+area_t markers_t::bounding_box(float epsilon)
+{
+    if (is_bounding_box_valid(epsilon))
+    {
+        return m_bounding_box;
+    }
+    area_t area = null_bounding_box();
+    area_t marker = m_marker->bounding_box(epsilon);
+    if (!m_points.empty() && marker.m_min.m_x <= marker.m_max.m_x)
+    {
+        bool const sizes = m_sizes.size() == m_points.size();
+        area = markers_bounding_box(m_points.data(), sizes ? m_sizes.data() : nullptr, m_points.size(), marker);
+    }
+    cache_bounding_box(area, epsilon);
+    return area;
+}
+
+// Moves the markers, the marker itself keeps its shape and size
+void markers_t::apply(transformation_t const& t, bool)
+{
+    for (point_t& p : m_points)
+    {
+        p *= t;
+    }
+    invalidate_bounding_box();
+}
+
+image_t::image_t(iproperties_t const& parent_properties)
+    : shape_t(parent_properties)
+    , m_pixels(nullptr)
+    , m_width(0)
+    , m_height(0)
+    , m_components(1)
+    , m_runlength(false)
+    , m_origin(0.f, 0.f)
+    , m_x_corner(1.f, 0.f)
+    , m_y_corner(0.f, 1.f)
+{}
+
+// The pixels are not copied, they must stay valid until the image is drawn.
+// Rows are stored top row first, components is 1 (gray) or 3 (rgb). Pixels
+// changed in place need another setpixels() to be drawn again when the
+// canvas caches what shapes write.
+void image_t::setpixels(uint8_t const* pixels, int width, int height, int components)
+{
+    if (components != 1 && components != 3)
+    {
+        THROW(std::invalid_argument, "E0102", << "Unsupported number of image components " << components);
+    }
+    m_pixels = pixels;
+    m_width = width;
+    m_height = height;
+    m_components = components;
+    invalidate_emission();
+}
+
+void image_t::setarea(area_t area)
+{
+    m_origin = area.m_min;
+    m_x_corner = point_t(area.m_max.m_x, area.m_min.m_y);
+    m_y_corner = point_t(area.m_min.m_x, area.m_max.m_y);
+    invalidate_bounding_box();
+}
+
+void image_t::setrunlength(bool runlength)
+{
+    m_runlength = runlength;
+    invalidate_emission();
+}
+
+void image_t::draw(std::ostream& stream, graphicsstate_t&) const
+{
+    if (!m_pixels || m_width <= 0 || m_height <= 0)
+    {
+        return;
+    }
+    gsave(stream);
+    stream << "[" << (m_x_corner - m_origin) << ' ' << (m_y_corner - m_origin) << ' ' << m_origin << "] concat\n";
+    stream << m_width << ' ' << m_height << " 8 [" << m_width << " 0 0 " << -m_height << " 0 " << m_height << "]\n";
+    stream << "currentfile /ASCII85Decode filter" << (m_runlength ? " /RunLengthDecode filter" : "")
+        << (m_components == 3 ? " false 3 colorimage\n" : " image\n");
+    size_t const size = static_cast<size_t>(m_width) * m_height * m_components;
+    std::unique_ptr<ascii85_writer_t> ascii85 = std::make_unique<ascii85_writer_t>(stream);
+    if (m_runlength)
+    {
+        std::unique_ptr<runlength_writer_t> runlength = std::make_unique<runlength_writer_t>(*ascii85);
+        runlength->write(m_pixels, size);
+        runlength->close();
+    }
+    else
+    {
+        ascii85->write(m_pixels, size);
+    }
+    ascii85->close();
+    grestore(stream);
+}
+
+area_t image_t::bounding_box(float epsilon)
+{
+    if (is_bounding_box_valid(epsilon))
+    {
+        return m_bounding_box;
+    }
+    point_t corner(m_x_corner.m_x + m_y_corner.m_x - m_origin.m_x, m_x_corner.m_y + m_y_corner.m_y - m_origin.m_y);
+    area_t area = null_bounding_box();
+    for (point_t p : { m_origin, m_x_corner, m_y_corner, corner })
+    {
+        min_bounding_box(area.m_min, p);
+        max_bounding_box(area.m_max, p);
+    }
+    cache_bounding_box(area, epsilon);
+    return area;
+}
+
+void image_t::apply(transformation_t const& t, bool)
+{
+    m_origin *= t;
+    m_x_corner *= t;
+    m_y_corner *= t;
+    invalidate_bounding_box();
+}
+
+mesh_t::mesh_t(iproperties_t const& parent_properties)
+    : shape_t(parent_properties)
+    , m_vertices_per_row(0)
+{}
+
+// colors holds r g b in [0, 1] per vertex
+void mesh_t::setvertices(std::vector<point_t> vertices, std::vector<float> colors)
+{
+    if (colors.size() != 3 * vertices.size())
+    {
+        THROW(std::invalid_argument, "E0103", << "Expected 3 color components per mesh vertex");
+    }
+    m_vertices = std::move(vertices);
+    m_colors = std::move(colors);
+    invalidate_bounding_box();
+}
+
+// Free-form mesh: three vertex indices per triangle
+void mesh_t::settriangles(std::vector<uint32_t> triangles)
+{
+    m_triangles = std::move(triangles);
+    m_vertices_per_row = 0;
+    invalidate_emission();
+}
+
+// Lattice-form mesh: the vertices are rows of vertices_per_row vertices
+void mesh_t::setlattice(int vertices_per_row)
+{
+    m_vertices_per_row = vertices_per_row;
+    m_triangles.clear();
+    invalidate_emission();
+}
+
+// Gouraud shaded with the level 3 shfill operator. The vertices are written
+// as a binary stream through ASCII85: an 8 bit edge flag (free-form only),
+// 16 bit coordinates scaled over the bounding box by the Decode array and
+// 8 bit color components. A free-form triangle that continues a strip or a
+// fan from the previous one only writes its new vertex.
+void mesh_t::draw(std::ostream& stream, graphicsstate_t&) const
+{
+    bool const lattice = m_vertices_per_row >= 2;
+    if (m_vertices.empty() || (lattice ? m_vertices.size() < 2 * static_cast<size_t>(m_vertices_per_row) : m_triangles.size() < 3))
+    {
+        return;
+    }
+    area_t area = markers_bounding_box(m_vertices.data(), nullptr, m_vertices.size(), area_t(point_t(0.f, 0.f), point_t(0.f, 0.f)));
+    float const dx = area.m_max.m_x > area.m_min.m_x ? area.m_max.m_x - area.m_min.m_x : 1.f;
+    float const dy = area.m_max.m_y > area.m_min.m_y ? area.m_max.m_y - area.m_min.m_y : 1.f;
+    stream << "<< /ShadingType " << (lattice ? 5 : 4) << " /ColorSpace /DeviceRGB"
+        << " /BitsPerCoordinate 16 /BitsPerComponent 8";
+    if (lattice)
+    {
+        stream << " /VerticesPerRow " << m_vertices_per_row << "\n";
+    }
+    else
+    {
+        stream << " /BitsPerFlag 8\n";
+    }
+    stream << "/Decode [";
+    write_number(stream, area.m_min.m_x);
+    stream << ' ';
+    write_number(stream, area.m_min.m_x + dx);
+    stream << ' ';
+    write_number(stream, area.m_min.m_y);
+    stream << ' ';
+    write_number(stream, area.m_min.m_y + dy);
+    stream << " 0 1 0 1 0 1]\n";
+    stream << "/DataSource currentfile /ASCII85Decode filter >> shfill\n";
+
+    std::unique_ptr<ascii85_writer_t> ascii85 = std::make_unique<ascii85_writer_t>(stream);
+    uint8_t buffer[8 * 1024];
+    size_t size = 0;
+    auto vertex = [&](int flag, uint32_t i)
+    {
+        if (i >= m_vertices.size())
+        {
+            THROW(std::out_of_range, "E0104", << "Mesh vertex index " << i << " out of range");
+        }
+        if (size + 8 > sizeof(buffer))
+        {
+            ascii85->write(buffer, size);
+            size = 0;
+        }
+        if (flag >= 0)
+        {
+            buffer[size++] = static_cast<uint8_t>(flag);
+        }
+        uint32_t x = static_cast<uint32_t>(std::lround(clip((m_vertices[i].m_x - area.m_min.m_x) / dx, 0.f, 1.f) * 65535));
+        uint32_t y = static_cast<uint32_t>(std::lround(clip((m_vertices[i].m_y - area.m_min.m_y) / dy, 0.f, 1.f) * 65535));
+        buffer[size++] = static_cast<uint8_t>(x >> 8);
+        buffer[size++] = static_cast<uint8_t>(x);
+        buffer[size++] = static_cast<uint8_t>(y >> 8);
+        buffer[size++] = static_cast<uint8_t>(y);
+        for (size_t c = 3 * i; c < 3 * i + 3; ++c)
+        {
+            buffer[size++] = static_cast<uint8_t>(std::lround(clip(m_colors[c], 0.f, 1.f) * 255));
+        }
+    };
+    if (lattice)
+    {
+        size_t const n = m_vertices.size() - m_vertices.size() % m_vertices_per_row;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            vertex(-1, i);
+        }
+    }
+    else
+    {
+        uint32_t const* previous = nullptr;
+        for (size_t t = 0; t + 3 <= m_triangles.size(); t += 3)
+        {
+            uint32_t const* v = &m_triangles[t];
+            if (previous && v[0] == previous[1] && v[1] == previous[2])
+            {
+                vertex(1, v[2]); // strip: vb vc vd
+            }
+            else if (previous && v[0] == previous[0] && v[1] == previous[2])
+            {
+                vertex(2, v[2]); // fan: va vc vd
+            }
+            else
+            {
+                vertex(0, v[0]);
+                vertex(0, v[1]);
+                vertex(0, v[2]);
+            }
+            previous = v;
+        }
+    }
+    ascii85->write(buffer, size);
+    ascii85->close();
+}
+
+area_t mesh_t::bounding_box(float epsilon)
+{
+    if (is_bounding_box_valid(epsilon))
+    {
+        return m_bounding_box;
+    }
+    area_t area = m_vertices.empty() ? null_bounding_box() :
+        markers_bounding_box(m_vertices.data(), nullptr, m_vertices.size(), area_t(point_t(0.f, 0.f), point_t(0.f, 0.f)));
+    cache_bounding_box(area, epsilon);
+    return area;
+}
+
+void mesh_t::apply(transformation_t const& t, bool)
+{
+    for (point_t& p : m_vertices)
+    {
+        p *= t;
+    }
+    invalidate_bounding_box();
 }
 
-}; // namespace eps
\ No newline at end of file
+}; // namespace eps
@@ -9,7 +9,30 @@
 #include <stack>
 #include <regex>
 #include <set>
+#include <map>
 #include <iostream>
+#include <cmath>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <numeric>
+#include <memory_resource>
+#include <thread>
+#include <condition_variable>
+#include <climits>
+#include <cerrno>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <string_view>
 
 namespace // anonymous
 {
@@ -126,6 +149,699 @@ void arc_points_of_tangency(
     }
 }
 
+eps::area_t integral_bounding_box(eps::area_t area)
+{
+    if (area.m_min.m_x > area.m_max.m_x)
+    {
+        return eps::area_t(eps::point_t(0.f, 0.f), eps::point_t(0.f, 0.f)); // empty canvas
+    }
+    area.m_min.m_x = std::floor(area.m_min.m_x);
+    area.m_min.m_y = std::floor(area.m_min.m_y);
+    area.m_max.m_x = std::ceil(area.m_max.m_x);
+    area.m_max.m_y = std::ceil(area.m_max.m_y);
+    return area;
+}
+
+// Touching boxes intersect; an empty box intersects nothing.
+bool intersects(eps::area_t const& a, eps::area_t const& b)
+{
+    return a.m_min.m_x <= b.m_max.m_x && b.m_min.m_x <= a.m_max.m_x &&
+        a.m_min.m_y <= b.m_max.m_y && b.m_min.m_y <= a.m_max.m_y;
+}
+
+// Whether b lies inside a, its edges included.
+bool contains(eps::area_t const& a, eps::area_t const& b)
+{
+    return a.m_min.m_x <= b.m_min.m_x && b.m_max.m_x <= a.m_max.m_x &&
+        a.m_min.m_y <= b.m_min.m_y && b.m_max.m_y <= a.m_max.m_y;
+}
+
+// The box around the transformed corners of the area; exact unless the
+// transformation rotates.
+eps::area_t transformed_area(eps::area_t const& area, eps::transformation_t const& t)
+{
+    if (area.m_min.m_x > area.m_max.m_x)
+    {
+        return area; // empty
+    }
+    eps::area_t result = eps::null_bounding_box();
+    for (eps::point_t p : { area.m_min, area.m_max, eps::point_t(area.m_min.m_x, area.m_max.m_y), eps::point_t(area.m_max.m_x, area.m_min.m_y) })
+    {
+        p *= t;
+        eps::min_bounding_box(result.m_min, p);
+        eps::max_bounding_box(result.m_max, p);
+    }
+    return result;
+}
+
+eps::area_t intersection(eps::area_t a, eps::area_t const& b)
+{
+    a.m_min.m_x = std::max(a.m_min.m_x, b.m_min.m_x);
+    a.m_min.m_y = std::max(a.m_min.m_y, b.m_min.m_y);
+    a.m_max.m_x = std::min(a.m_max.m_x, b.m_max.m_x);
+    a.m_max.m_y = std::min(a.m_max.m_y, b.m_max.m_y);
+    return a;
+}
+
+// The area grown by the margin on every side; an empty area stays empty.
+eps::area_t inflated(eps::area_t a, float margin)
+{
+    if (a.m_min.m_x > a.m_max.m_x)
+    {
+        return a;
+    }
+    a.m_min.m_x -= margin;
+    a.m_min.m_y -= margin;
+    a.m_max.m_x += margin;
+    a.m_max.m_y += margin;
+    return a;
+}
+
+// The area a shape may paint: its bounding box widened by how far its
+// strokes reach beyond it.
+eps::area_t painted_area(eps::shape_t& shape, float epsilon)
+{
+    return inflated(shape.bounding_box(epsilon), shape.painted_margin() + epsilon);
+}
+
+// Coordinates are formatted without iostream's locale aware num_put. The
+// precision is kept per stream in an iword slot: 0 (the default) gives the
+// same 6 significant digits as operator<<, n > 0 gives at most n - 1
+// decimals.
+int const precision_index = std::ios_base::xalloc();
+
+// Names of procedures and data defined while drawing get a per stream
+// sequence number, kept in an iword slot. Procedures that group_t defines
+// for repeated geometry have this prefix, they only construct a path.
+char const instance_prefix[] = "_i";
+int const instance_index = std::ios_base::xalloc();
+
+// Polyline simplification switched on for all paths written to a stream,
+// and the number of points it removed.
+int const simplify_index = std::ios_base::xalloc();
+int const simplified_index = std::ios_base::xalloc();
+
+// The number of style changes saved by groups that reorder their shapes.
+int const reordered_index = std::ios_base::xalloc();
+
+// The viewport of the canvas being drawn, an area_t in pword; groups skip
+// shapes outside of it.
+int const viewport_index = std::ios_base::xalloc();
+
+// The path_encoding_t of a stream, and the number of bytes that relative
+// segments and aliases saved over writing all segments absolute.
+int const encoding_index = std::ios_base::xalloc();
+int const encoded_index = std::ios_base::xalloc();
+
+// The per stream counters that are added up when parts of a stream are
+// written elsewhere first: by chunks drawn in parallel, or replayed from a
+// shape's emission cache.
+int const chunk_counters[] = { simplified_index, reordered_index, encoded_index };
+size_t const number_of_chunk_counters = sizeof(chunk_counters) / sizeof(chunk_counters[0]);
+
+// Emission caching switched on for a stream, and how many shapes were
+// copied from their cache or drawn, and the bytes copied. Shapes that are
+// drawn past their cache, in parallel or through an instance procedure,
+// count as drawn and also as bypassed. Chunks drawn in parallel add up
+// the counters of the shapes nested in them.
+int const caching_index = std::ios_base::xalloc();
+int const cache_hits_index = std::ios_base::xalloc();
+int const cache_misses_index = std::ios_base::xalloc();
+int const cache_reused_index = std::ios_base::xalloc();
+int const cache_bypassed_index = std::ios_base::xalloc();
+int const cache_counters[] = { cache_hits_index, cache_misses_index, cache_reused_index, cache_bypassed_index };
+size_t const number_of_cache_counters = sizeof(cache_counters) / sizeof(cache_counters[0]);
+// The buffer that a stream writes to while what shapes write is captured,
+// in pword. Shapes drawn into it take their bytes from there.
+int const capture_index = std::ios_base::xalloc();
+
+// Groups are split into chunks of at least this many shapes when they are
+// worked on in parallel, smaller ones are not worth the threads.
+size_t const min_chunk_size = 1024;
+
+// Runs work(k) for k in [0, n) on at most threads threads, the calling one
+// included. The first exception that work throws is rethrown.
+template<typename F>
+void parallel_for(unsigned threads, size_t n, F const& work)
+{
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]()
+    {
+        for (size_t k = next++; k < n; k = next++)
+        {
+            try
+            {
+                work(k);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads && t < n; ++t)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& t : pool)
+    {
+        t.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+float segment_distance(eps::point_t p, eps::point_t a, eps::point_t b)
+{
+    float const abx = b.m_x - a.m_x;
+    float const aby = b.m_y - a.m_y;
+    float const apx = p.m_x - a.m_x;
+    float const apy = p.m_y - a.m_y;
+    float const ab2 = abx * abx + aby * aby;
+    float t = ab2 > 0 ? (apx * abx + apy * aby) / ab2 : 0.f;
+    t = std::min(std::max(t, 0.f), 1.f);
+    float const dx = apx - t * abx;
+    float const dy = apy - t * aby;
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+// Douglas-Peucker: marks the points of window that are needed to stay
+// within epsilon, the first and the last are always kept.
+void douglas_peucker(std::vector<eps::point_t> const& window, float epsilon, std::vector<uint8_t>& keep,
+    std::vector<std::pair<size_t, size_t>>& stack)
+{
+    keep.assign(window.size(), 0);
+    keep.front() = 1;
+    keep.back() = 1;
+    stack.emplace_back(0, window.size() - 1);
+    while (!stack.empty())
+    {
+        std::pair<size_t, size_t> range = stack.back();
+        stack.pop_back();
+        float dmax = -1.f;
+        size_t index = range.first;
+        for (size_t i = range.first + 1; i < range.second; ++i)
+        {
+            float d = segment_distance(window[i], window[range.first], window[range.second]);
+            if (d > dmax)
+            {
+                dmax = d;
+                index = i;
+            }
+        }
+        if (dmax > epsilon)
+        {
+            keep[index] = 1;
+            stack.emplace_back(range.first, index);
+            stack.emplace_back(index, range.second);
+        }
+    }
+}
+
+int64_t const power_of_ten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+// Writes n / scale with at most the decimals of scale.
+char* format_scaled(char* first, char* last, int64_t n, int64_t scale)
+{
+    if (n < 0)
+    {
+        *first++ = '-';
+        n = -n;
+    }
+    first = std::to_chars(first, last, n / scale).ptr;
+    int64_t fraction = n % scale;
+    if (fraction)
+    {
+        *first++ = '.';
+        for (int64_t d = scale / 10; fraction; d /= 10)
+        {
+            *first++ = static_cast<char>('0' + fraction / d);
+            fraction %= d;
+        }
+    }
+    return first;
+}
+
+char* format_number(char* first, char* last, float v, int decimals)
+{
+    if (decimals < 0 || decimals > 9 || !(std::fabs(v) < 1e9f))
+    {
+        return std::to_chars(first, last, v, std::chars_format::general, 6).ptr;
+    }
+    int64_t const scale = power_of_ten[decimals];
+    return format_scaled(first, last, std::llround(static_cast<double>(v) * scale), scale);
+}
+
+// Whether v and w are written the same with these decimals, see
+// format_number().
+bool same_number(float v, float w, int decimals)
+{
+    if (v == w)
+    {
+        return true;
+    }
+    if (decimals >= 0 && decimals <= 9 && std::fabs(v) < 1e9f && std::fabs(w) < 1e9f)
+    {
+        int64_t const scale = power_of_ten[decimals];
+        return std::llround(static_cast<double>(v) * scale) == std::llround(static_cast<double>(w) * scale);
+    }
+    char a[32];
+    char b[32];
+    char* const a_last = format_number(a, a + sizeof(a), v, decimals);
+    char* const b_last = format_number(b, b + sizeof(b), w, decimals);
+    return a_last - a == b_last - b && std::equal(a, a_last, b);
+}
+
+enum segment_t { segment_lineto, segment_curveto };
+
+// The operators of a segment: absolute, relative and their aliases.
+char const* const segment_operators[][4] =
+{
+    { " lineto\n", " rlineto\n", " L\n", " l\n" },
+    { " curveto\n", " rcurveto\n", " C\n", " c\n" },
+};
+
+// Writes a segment from current through the n points, relative when that is
+// shorter than absolute. The offsets are differences of the rounded
+// coordinates, so that rounding errors do not add up along a path. Returns
+// false, without writing anything, when the stream does not encode
+// segments; that needs a fixed precision.
+bool write_segment(std::ostream& stream, eps::point_t current, eps::point_t const* points, size_t n, segment_t segment)
+{
+    long const encoding = stream.iword(encoding_index);
+    long const decimals = stream.iword(precision_index) - 1;
+    if (!encoding || decimals < 0 || decimals > 9)
+    {
+        return false;
+    }
+    int64_t const scale = power_of_ten[decimals];
+    auto scaled = [scale](float v) { return std::llround(static_cast<double>(v) * scale); };
+    if (!(std::fabs(current.m_x) < 1e9f && std::fabs(current.m_y) < 1e9f))
+    {
+        return false;
+    }
+    int64_t const cx = scaled(current.m_x);
+    int64_t const cy = scaled(current.m_y);
+    char absolute[192];
+    char relative[192];
+    char* a = absolute;
+    char* r = relative;
+    char* const a_last = absolute + sizeof(absolute);
+    char* const r_last = relative + sizeof(relative);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (!(std::fabs(points[i].m_x) < 1e9f && std::fabs(points[i].m_y) < 1e9f))
+        {
+            return false;
+        }
+        int64_t const x = scaled(points[i].m_x);
+        int64_t const y = scaled(points[i].m_y);
+        if (i)
+        {
+            *a++ = ' ';
+            *r++ = ' ';
+        }
+        a = format_scaled(a, a_last, x, scale);
+        *a++ = ' ';
+        a = format_scaled(a, a_last, y, scale);
+        r = format_scaled(r, r_last, x - cx, scale);
+        *r++ = ' ';
+        r = format_scaled(r, r_last, y - cy, scale);
+    }
+    char const* const* operators = segment_operators[segment];
+    int const alias = encoding == static_cast<long>(eps::path_encoding_t::relative_aliases) ? 2 : 0;
+    size_t const plain = (a - absolute) + std::strlen(operators[0]);
+    char const* op = operators[alias];
+    if (r - relative < a - absolute)
+    {
+        std::memcpy(absolute, relative, r - relative);
+        a = absolute + (r - relative);
+        op = operators[alias + 1];
+    }
+    size_t const op_size = std::strlen(op);
+    std::memcpy(a, op, op_size);
+    a += op_size;
+    stream.write(absolute, a - absolute);
+    stream.iword(encoded_index) += plain - (a - absolute);
+    return true;
+}
+
+struct number_t
+{
+    float m_v;
+};
+
+number_t number(float v)
+{
+    return number_t{ v };
+}
+
+std::ostream& operator<<(std::ostream& o, number_t n)
+{
+    eps::write_number(o, n.m_v);
+    return o;
+}
+
+// Peephole optimizer between the emitters and the output stream. It sees
+// the PostScript a line at a time and tracks the graphics state operators
+// that are really in effect, including across gsave/grestore, so that the
+// ones that would not change anything are dropped. A stroke that is followed
+// by a new path which is stroked with the same state is merged into one
+// path: "stroke newpath" is removed. Fills are never merged, overlapping
+// subpaths would change the nonzero winding result. Data read with
+// currentfile, up to its ~> end marker, is passed on untouched.
+class peephole_t
+    : public std::streambuf
+{
+public:
+    explicit peephole_t(std::streambuf* target)
+        : m_target(target)
+        , m_depth(0)
+        , m_raw(false)
+        , m_stroke_pending(false)
+        , m_merging(false)
+        , m_matrix_depth(0)
+        , m_path_lines(0)
+        , m_segments(0)
+        , m_bytes_in(0)
+        , m_bytes_out(0)
+        , m_operators_removed(0)
+        , m_paths_merged(0)
+    {}
+    void report(std::ostream& stream) const
+    {
+        stream << "peephole optimizer: "
+            << m_bytes_in - m_bytes_out << " of " << m_bytes_in << " bytes removed, "
+            << m_operators_removed << " operators removed, "
+            << m_paths_merged << " paths merged\n";
+    }
+    // A new document starts from the interpreter's state, nothing of the
+    // previous one is in effect any more, and is counted on its own.
+    void reset()
+    {
+        flush_pending();
+        m_line.clear();
+        m_state = state_t();
+        m_saved.clear();
+        m_depth = 0;
+        m_raw = false;
+        m_segments = 0;
+        m_bytes_in = 0;
+        m_bytes_out = 0;
+        m_operators_removed = 0;
+        m_paths_merged = 0;
+    }
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+    std::streamsize xsputn(char const* s, std::streamsize n) override
+    {
+        char const* end = s + n;
+        while (s != end)
+        {
+            char const* eol = static_cast<char const*>(std::memchr(s, '\n', end - s));
+            if (!eol)
+            {
+                m_line.append(s, end);
+                break;
+            }
+            m_line.append(s, eol);
+            line(m_line);
+            m_line.clear();
+            s = eol + 1;
+        }
+        return n;
+    }
+    int sync() override
+    {
+        flush_pending();
+        return m_target->pubsync();
+    }
+private:
+    enum slot_t { slot_linewidth, slot_color, slot_dash, slot_linecap, slot_linejoin, slot_miterlimit, number_of_slots };
+    using state_t = std::array<std::string, number_of_slots>; // empty is unknown
+    static size_t const max_segments = 1000; // stay below the level 1 path limit of 1500
+
+    static std::string operator_of(std::string const& l)
+    {
+        std::string::size_type pos = l.find_last_of(' ');
+        return pos == std::string::npos ? l : l.substr(pos + 1);
+    }
+    static int brace_balance(std::string const& l)
+    {
+        int balance = 0;
+        int string_depth = 0;
+        for (std::string::size_type i = 0; i < l.size(); ++i)
+        {
+            char c = l[i];
+            if (string_depth)
+            {
+                if (c == '\\') ++i;
+                else if (c == '(') ++string_depth;
+                else if (c == ')') --string_depth;
+            }
+            else if (c == '(') ++string_depth;
+            else if (c == '%') break;
+            else if (c == '{') ++balance;
+            else if (c == '}') --balance;
+        }
+        return balance;
+    }
+    static int slot_of(std::string const& op)
+    {
+        if (op == "setlinewidth") return slot_linewidth;
+        if (op == "setgray" || op == "setrgbcolor" || op == "sethsbcolor" || op == "setcmykcolor") return slot_color;
+        if (op == "setdash") return slot_dash;
+        if (op == "setlinecap") return slot_linecap;
+        if (op == "setlinejoin") return slot_linejoin;
+        if (op == "setmiterlimit") return slot_miterlimit;
+        return -1;
+    }
+    static bool is_path(std::string const& op)
+    {
+        return op == "moveto" || op == "lineto" || op == "curveto" ||
+            op == "rmoveto" || op == "rlineto" || op == "rcurveto" ||
+            op == "L" || op == "l" || op == "C" || op == "c" ||
+            op == "arc" || op == "arcn" || op == "arct" || op == "closepath" ||
+            op == "currentmatrix" || op == "concat" || op == "setmatrix" ||
+            op.compare(0, sizeof(instance_prefix) - 1, instance_prefix) == 0;
+    }
+    // operators that leave the tracked state alone
+    static bool is_neutral(std::string const& op)
+    {
+        return op == "fill" || op == "eofill" || op == "clip" || op == "eoclip" ||
+            op == "show" || op == "selectfont" || op == "def" ||
+            op == "translate" || op == "scale" || op == "rotate";
+    }
+    bool is_redundant(std::string const& l, std::string const& op) const
+    {
+        int slot = slot_of(op);
+        return slot >= 0 && m_state[slot] == l;
+    }
+    void emit(char const* s, size_t n)
+    {
+        m_target->sputn(s, n);
+        m_bytes_out += n;
+    }
+    void emit(std::string const& l)
+    {
+        emit(l.data(), l.size());
+        emit("\n", 1);
+    }
+    void flush_pending()
+    {
+        if (m_stroke_pending)
+        {
+            m_stroke_pending = false;
+            emit("stroke\n", 7);
+        }
+        if (m_merging)
+        {
+            m_merging = false;
+            emit("newpath\n", 8);
+            emit(m_path.data(), m_path.size());
+            m_segments = m_path_lines;
+            m_path.clear();
+        }
+    }
+    void line(std::string const& l)
+    {
+        m_bytes_in += l.size() + 1;
+        if (m_raw)
+        {
+            emit(l);
+            m_raw = l.size() < 2 || l.compare(l.size() - 2, 2, "~>") != 0;
+            return;
+        }
+        if (l.find("currentfile") != std::string::npos)
+        {
+            flush_pending();
+            emit(l);
+            m_state = state_t();
+            m_raw = true;
+            return;
+        }
+        int balance = brace_balance(l);
+        if (m_depth > 0 || balance != 0 || l.empty() || l[0] == '%')
+        {
+            // procedure bodies are not executed here, pass them on untouched
+            flush_pending();
+            emit(l);
+            m_depth += balance;
+            return;
+        }
+        std::string op = operator_of(l);
+        if (m_merging)
+        {
+            if (merge(l, op))
+            {
+                return;
+            }
+            flush_pending();
+        }
+        else if (m_stroke_pending)
+        {
+            if (l == "newpath")
+            {
+                m_merging = true;
+                m_matrix_depth = 0;
+                m_path_lines = 0;
+                return;
+            }
+            if (is_redundant(l, op))
+            {
+                ++m_operators_removed;
+                return;
+            }
+            flush_pending();
+        }
+        process(l, op);
+    }
+    bool merge(std::string const& l, std::string const& op)
+    {
+        if (is_path(op))
+        {
+            if (m_segments + m_path_lines + 1 > max_segments)
+            {
+                return false;
+            }
+            if (op == "currentmatrix")
+            {
+                ++m_matrix_depth;
+            }
+            else if (op == "setmatrix" || op == "concat")
+            {
+                if (m_matrix_depth == 0)
+                {
+                    return false; // the stroke would see another matrix
+                }
+                m_matrix_depth -= op == "setmatrix";
+            }
+            ++m_path_lines;
+            m_path.append(l).append(1, '\n');
+            return true;
+        }
+        if (is_redundant(l, op))
+        {
+            ++m_operators_removed;
+            return true;
+        }
+        if (l == "stroke" && m_matrix_depth == 0)
+        {
+            m_merging = false;
+            emit(m_path.data(), m_path.size());
+            m_segments += m_path_lines;
+            m_path.clear();
+            m_operators_removed += 2;
+            ++m_paths_merged;
+            return true; // the stroke stays pending
+        }
+        return false;
+    }
+    void process(std::string const& l, std::string const& op)
+    {
+        int slot = slot_of(op);
+        if (slot >= 0)
+        {
+            if (m_state[slot] == l)
+            {
+                ++m_operators_removed;
+                return;
+            }
+            m_state[slot] = l;
+        }
+        else if (op == "gsave")
+        {
+            m_saved.push_back(m_state);
+        }
+        else if (op == "grestore")
+        {
+            if (m_saved.empty())
+            {
+                m_state = state_t();
+            }
+            else
+            {
+                m_state = m_saved.back();
+                m_saved.pop_back();
+            }
+        }
+        else if (l == "newpath")
+        {
+            m_segments = 0;
+        }
+        else if (l == "stroke")
+        {
+            m_stroke_pending = true;
+            return;
+        }
+        else if (is_path(op))
+        {
+            ++m_segments;
+        }
+        else if (!is_neutral(op))
+        {
+            m_state = state_t(); // e.g. a procedure call, anything may have changed
+        }
+        emit(l);
+    }
+
+    std::streambuf* m_target;
+    std::string m_line;
+    state_t m_state;
+    std::vector<state_t> m_saved;
+    int m_depth;
+    bool m_raw;
+    bool m_stroke_pending;
+    bool m_merging;
+    int m_matrix_depth;
+    std::string m_path; // the path that is being merged, after its newpath
+    size_t m_path_lines;
+    size_t m_segments; // of the path that is being stroked
+    uint64_t m_bytes_in;
+    uint64_t m_bytes_out;
+    uint64_t m_operators_removed;
+    uint64_t m_paths_merged;
+};
+
 }; // anonymous
 
 namespace eps
@@ -133,12 +849,12 @@ namespace eps
 
 std::ostream& operator<<(std::ostream& o, eps::vect_t v)
 {
-    return o << v.m_x << ' ' << v.m_y;
+    return o << number(v.m_x) << ' ' << number(v.m_y);
 }
 
 std::ostream& operator<<(std::ostream& o, eps::point_t v)
 {
-    return o << v.m_x << ' ' << v.m_y;
+    return o << number(v.m_x) << ' ' << number(v.m_y);
 }
 
 std::ostream& operator<<(std::ostream& o, eps::area_t a)
@@ -156,6 +872,28 @@ std::ostream& operator<<(std::ostream& o, eps::transformation_t t)
     return o << "[ " << t.m_r << ' ' << t.m_t << " ]";
 }
 
+void set_precision(std::ostream& stream, int decimals)
+{
+    stream.iword(precision_index) = decimals < 0 ? 0 : decimals + 1;
+}
+
+void write_number(std::ostream& stream, float v)
+{
+    char buffer[48];
+    char* end = format_number(buffer, buffer + sizeof(buffer), v, static_cast<int>(stream.iword(precision_index)) - 1);
+    stream.write(buffer, end - buffer);
+}
+
+area_t const* viewport(std::ostream& stream)
+{
+    return static_cast<area_t const*>(stream.pword(viewport_index));
+}
+
+std::string unique_name(std::ostream& stream, char const* prefix)
+{
+    return prefix + std::to_string(stream.iword(instance_index)++);
+}
+
 area_t null_bounding_box()
 {
     return area_t(
@@ -163,8 +901,8 @@ area_t null_bounding_box()
             std::numeric_limits<float>::max(),
             std::numeric_limits<float>::max()),
         point_t(
-            std::numeric_limits<float>::min(),
-            std::numeric_limits<float>::min()));
+            std::numeric_limits<float>::lowest(),
+            std::numeric_limits<float>::lowest()));
 }
 
 struct lineending_none_t
@@ -191,6 +929,13 @@ float get_epsilon(graphicsstate_t& graphicsstate)
     return graphicsstate.epsilon();
 }
 
+// How far a stroke with these properties can reach beyond the geometry:
+// half the line width, times the miter limit for mitered joins.
+float stroke_margin(iproperties_t const& properties)
+{
+    return properties.linewidth() / 2 * (properties.linejoin() == join_t::miter ? std::max(properties.miterlimit(), 1.f) : 1.f);
+}
+
 void new_path(std::ostream& stream)
 {
     stream << "newpath\n";
@@ -201,70 +946,139 @@ void closepath(std::ostream& stream)
     stream << "closepath\n";
 }
 
-void stroke(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties)
+// The effective properties of a shape with its parents resolved, interned
+// by value, so that equal styles share one address that serves as their
+// id.
+#define RESOLVED_STYLE_PROPERTIES \
+    P(float, linewidth) \
+    P(float, linercolor) \
+    P(float, linegcolor) \
+    P(float, linebcolor) \
+    P(float, fillrcolor) \
+    P(float, fillgcolor) \
+    P(float, fillbcolor) \
+    P(cap_t, linecap) \
+    P(join_t, linejoin) \
+    P(float, miterlimit) \
+    P(float, epsilon) \
+    P(lineending_t*, lineend) \
+    P(lineending_t*, linebegin) \
+    P(linestyle_t*, linestyle)
+
+struct resolved_style_t
+{
+    resolved_style_t(iproperties_t const& properties)
+#define P(TYPE, NAME) m_##NAME = properties.NAME();
+    {
+        RESOLVED_STYLE_PROPERTIES
+    }
+#undef P
+    resolved_style_t(resolved_style_t const& parent, properties_override_t const& properties_override)
+#define P(TYPE, NAME) m_##NAME = properties_override.NAME(parent.m_##NAME);
+    {
+        RESOLVED_STYLE_PROPERTIES
+    }
+#undef P
+    bool operator==(resolved_style_t const& other) const
+    {
+#define P(TYPE, NAME) && m_##NAME == other.m_##NAME
+        return true RESOLVED_STYLE_PROPERTIES;
+#undef P
+    }
+#define P(TYPE, NAME) TYPE m_##NAME;
+    RESOLVED_STYLE_PROPERTIES
+#undef P
+};
+
+// The graphics state remembers the resolved style it was last set up for;
+// any change to it clears that again. Shapes with the same style then
+// skip the comparison field by field.
+void setstrokestate(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties)
 {
-    if (properties.linewidth() != graphicsstate.linewidth())
+    resolved_style_t const* style = properties.resolved_style();
+    if (graphicsstate.m_stroke_style == style)
+    {
+        return;
+    }
+    if (style->m_linewidth != graphicsstate.linewidth())
     {
-        graphicsstate.setlinewidth(properties.linewidth());
-        stream << graphicsstate.linewidth() << " setlinewidth\n";
+        graphicsstate.setlinewidth(style->m_linewidth);
+        stream << number(graphicsstate.linewidth()) << " setlinewidth\n";
     }
-    if ((properties.linercolor() != graphicsstate.linercolor()) ||
-        (properties.linegcolor() != graphicsstate.linegcolor()) ||
-        (properties.linebcolor() != graphicsstate.linebcolor()))
+    if ((style->m_linercolor != graphicsstate.linercolor()) ||
+        (style->m_linegcolor != graphicsstate.linegcolor()) ||
+        (style->m_linebcolor != graphicsstate.linebcolor()))
     {
         graphicsstate.setlinergbcolor(
-            properties.linercolor(), properties.linegcolor(), properties.linebcolor());
+            style->m_linercolor, style->m_linegcolor, style->m_linebcolor);
         if ((graphicsstate.linercolor() == graphicsstate.linegcolor()) && (graphicsstate.linegcolor() == graphicsstate.linebcolor()))
         {
-            stream << graphicsstate.linercolor() << " setgray\n";
+            stream << number(graphicsstate.linercolor()) << " setgray\n";
         }
         else
         {
-            stream << graphicsstate.linercolor() << ' ' << graphicsstate.linegcolor() << ' ' << graphicsstate.linebcolor() << ' ' << " setrgbcolor\n";
+            stream << number(graphicsstate.linercolor()) << ' ' << number(graphicsstate.linegcolor()) << ' ' << number(graphicsstate.linebcolor()) << " setrgbcolor\n";
         }
-        graphicsstate.setfillrgbcolor(properties.linercolor(), properties.linegcolor(), properties.linebcolor());
+        graphicsstate.setfillrgbcolor(style->m_linercolor, style->m_linegcolor, style->m_linebcolor);
     }
-    if (properties.linestyle() != graphicsstate.linestyle())
+    if (style->m_linestyle != graphicsstate.linestyle())
     {
-        graphicsstate.setlinestyle(properties.linestyle());
+        graphicsstate.setlinestyle(style->m_linestyle);
         graphicsstate.linestyle()->draw(stream);
     }
-    if (properties.linecap() != graphicsstate.linecap())
+    if (style->m_linecap != graphicsstate.linecap())
     {
-        graphicsstate.setlinecap(properties.linecap());
+        graphicsstate.setlinecap(style->m_linecap);
         stream << static_cast<int>(graphicsstate.linecap()) << " setlinecap\n";
     }
-    if (properties.linejoin() != graphicsstate.linejoin())
+    if (style->m_linejoin != graphicsstate.linejoin())
     {
-        graphicsstate.setlinejoin(properties.linejoin());
+        graphicsstate.setlinejoin(style->m_linejoin);
         stream << static_cast<int>(graphicsstate.linejoin()) << " setlinejoin\n";
     }
-    if (properties.miterlimit() != graphicsstate.miterlimit())
+    if (style->m_miterlimit != graphicsstate.miterlimit())
     {
-        graphicsstate.setmiterlimit(properties.miterlimit());
-        stream << graphicsstate.miterlimit() << " setmiterlimit\n";
+        graphicsstate.setmiterlimit(style->m_miterlimit);
+        stream << number(graphicsstate.miterlimit()) << " setmiterlimit\n";
     }
+    graphicsstate.m_stroke_style = style;
+}
+
+void stroke(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties)
+{
+    setstrokestate(stream, graphicsstate, properties);
     stream << "stroke\n";
 }
 
-void fill(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties, bool and_stroke) // clears moveto data!!
+void setfillstate(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties)
 {
-    if ((properties.fillrcolor() != graphicsstate.fillrcolor()) ||
-        (properties.fillgcolor() != graphicsstate.fillgcolor()) ||
-        (properties.fillbcolor() != graphicsstate.fillbcolor()))
+    resolved_style_t const* style = properties.resolved_style();
+    if (graphicsstate.m_fill_style == style)
+    {
+        return;
+    }
+    if ((style->m_fillrcolor != graphicsstate.fillrcolor()) ||
+        (style->m_fillgcolor != graphicsstate.fillgcolor()) ||
+        (style->m_fillbcolor != graphicsstate.fillbcolor()))
     {
         graphicsstate.setfillrgbcolor(
-            properties.fillrcolor(), properties.fillgcolor(), properties.fillbcolor());
+            style->m_fillrcolor, style->m_fillgcolor, style->m_fillbcolor);
         if ((graphicsstate.fillrcolor() == graphicsstate.fillgcolor()) && (graphicsstate.fillgcolor() == graphicsstate.fillbcolor()))
         {
-            stream << graphicsstate.fillrcolor() << " setgray\n";
+            stream << number(graphicsstate.fillrcolor()) << " setgray\n";
         }
         else
         { 
-            stream << graphicsstate.fillrcolor() << ' ' << graphicsstate.fillgcolor() << ' ' << graphicsstate.fillbcolor() << ' ' << " setrgbcolor\n";
+            stream << number(graphicsstate.fillrcolor()) << ' ' << number(graphicsstate.fillgcolor()) << ' ' << number(graphicsstate.fillbcolor()) << " setrgbcolor\n";
         }
-        graphicsstate.setlinergbcolor(properties.fillrcolor(), properties.fillgcolor(), properties.fillbcolor());
+        graphicsstate.setlinergbcolor(style->m_fillrcolor, style->m_fillgcolor, style->m_fillbcolor);
     }
+    graphicsstate.m_fill_style = style;
+}
+
+void fill(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties, bool and_stroke) // clears moveto data!!
+{
+    setfillstate(stream, graphicsstate, properties);
     if (and_stroke)
     {
         stream << "gsave\n";
@@ -309,34 +1123,151 @@ void lineto(std::ostream& stream, point_t p)
     stream << p << " lineto\n";
 }
 
-void rlineto(std::ostream& stream, vect_t v)
+// Writes lineto or rlineto, whichever is shorter. current must be the
+// current point exactly as it was written.
+void lineto(std::ostream& stream, point_t current, point_t p)
 {
-    stream << v << " rlineto\n";
+    if (!write_segment(stream, current, &p, 1, segment_lineto))
+    {
+        lineto(stream, p);
+    }
 }
 
-void curveto(std::ostream& stream, eps::point_t tangent1, eps::point_t tangent2, eps::point_t end)
+void set_simplify(std::ostream& stream, bool simplify)
 {
-    stream << tangent1 << ' ' << tangent2 << ' ' << end << " curveto\n";
+    stream.iword(simplify_index) = simplify;
 }
 
-void rcurveto(std::ostream& stream, eps::vect_t tangent1, eps::vect_t tangent2, eps::vect_t end)
+void set_encoding(std::ostream& stream, path_encoding_t encoding)
 {
-    stream << tangent1 << ' ' << tangent2 << ' ' << end << " rcurveto\n";
+    stream.iword(encoding_index) = static_cast<long>(encoding);
 }
 
-void arc(std::ostream& stream, eps::point_t center, float radius, float begin_angle, float end_angle)
+void set_caching(std::ostream& stream, bool caching)
 {
-    stream << center << ' ' << radius << ' ' << begin_angle << ' ' << end_angle << " arc\n";
+    stream.iword(caching_index) = caching;
 }
 
-void arcn(std::ostream& stream, eps::point_t center, float radius, float begin_angle, float end_angle)
+// The aliases of path_encoding_t::relative_aliases, they must be defined
+// before the first path is written.
+void draw_encoding_procedures(std::ostream& stream)
 {
-    stream << center << ' ' << radius << ' ' << begin_angle << ' ' << end_angle << " arcn\n";
-}
+    if (stream.iword(encoding_index) == static_cast<long>(path_encoding_t::relative_aliases))
+    {
+        stream << "/L {lineto} bind def\n/l {rlineto} bind def\n/C {curveto} bind def\n/c {rcurveto} bind def\n";
+    }
+}
+
+// Writes lineto for points[1] .. points[n - 1], relative to origin;
+// points[0] is the current point, see lineto(). Points that are written
+// the same as the previous one are always dropped, except the last. When
+// simplifying, Douglas-Peucker also removes the points that are within
+// epsilon of the line through their neighbours. It runs over windows of
+// at most 4096 points so memory does not grow with the length of the
+// polyline.
+void polyline(std::ostream& stream, point_t const* points, size_t n, point_t origin, float epsilon, bool simplify)
+{
+    auto at = [origin](point_t p) { return point_t(p.m_x - origin.m_x, p.m_y - origin.m_y); };
+    int const decimals = static_cast<int>(stream.iword(precision_index) - 1);
+    auto same_output = [decimals](point_t a, point_t b)
+    {
+        return same_number(a.m_x, b.m_x, decimals) && same_number(a.m_y, b.m_y, decimals);
+    };
+    point_t current = at(points[0]);
+    size_t removed = 0;
+    if (!(simplify || stream.iword(simplify_index)) || n < 3)
+    {
+        for (size_t i = 1; i < n; ++i)
+        {
+            point_t const p = at(points[i]);
+            if (i + 1 < n && same_output(p, current))
+            {
+                ++removed;
+                continue;
+            }
+            lineto(stream, current, p);
+            current = p;
+        }
+        stream.iword(simplified_index) += removed;
+        return;
+    }
+    size_t const max_window = 4096;
+    std::vector<point_t> window;
+    std::vector<uint8_t> keep;
+    std::vector<std::pair<size_t, size_t>> stack;
+    window.reserve(std::min(n, max_window));
+    window.push_back(points[0]);
+    for (size_t i = 1; i < n; ++i)
+    {
+        if (i + 1 < n && same_output(at(points[i]), at(window.back())))
+        {
+            ++removed;
+            continue;
+        }
+        window.push_back(points[i]);
+        if (window.size() < max_window && i + 1 < n)
+        {
+            continue;
+        }
+        douglas_peucker(window, epsilon, keep, stack);
+        for (size_t j = 1; j < window.size(); ++j)
+        {
+            if (keep[j])
+            {
+                point_t const p = at(window[j]);
+                lineto(stream, current, p);
+                current = p;
+            }
+            else
+            {
+                ++removed;
+            }
+        }
+        point_t last = window.back();
+        window.clear();
+        window.push_back(last);
+    }
+    stream.iword(simplified_index) += removed;
+}
+
+void rlineto(std::ostream& stream, vect_t v)
+{
+    stream << v << " rlineto\n";
+}
+
+void curveto(std::ostream& stream, eps::point_t tangent1, eps::point_t tangent2, eps::point_t end)
+{
+    stream << tangent1 << ' ' << tangent2 << ' ' << end << " curveto\n";
+}
+
+void rcurveto(std::ostream& stream, eps::vect_t tangent1, eps::vect_t tangent2, eps::vect_t end)
+{
+    stream << tangent1 << ' ' << tangent2 << ' ' << end << " rcurveto\n";
+}
+
+// Writes curveto or rcurveto, whichever is shorter, see lineto().
+void curveto(std::ostream& stream, eps::point_t current, eps::point_t tangent1, eps::point_t tangent2, eps::point_t end)
+{
+    eps::point_t const points[] = { tangent1, tangent2, end };
+    if (!write_segment(stream, current, points, 3, segment_curveto))
+    {
+        curveto(stream, tangent1, tangent2, end);
+    }
+}
+
+void arc(std::ostream& stream, eps::point_t center, float radius, float begin_angle, float end_angle)
+{
+    stream << center << ' ' << number(radius) << ' ' << number(begin_angle) << ' ' << number(end_angle) << " arc\n";
+}
+
+void arcn(std::ostream& stream, eps::point_t center, float radius, float begin_angle, float end_angle)
+{
+    stream << center << ' ' << number(radius) << ' ' << number(begin_angle) << ' ' << number(end_angle) << " arcn\n";
+}
 
 void arct(std::ostream& stream, eps::point_t tangent, eps::point_t end, float radius)
 {
-    stream << tangent << ' ' << end << ' ' << radius << " arct\n";
+    stream << tangent << ' ' << end << ' ' << number(radius) << " arct\n";
 }
 
 void show(std::ostream& stream, std::string const& text)
@@ -381,12 +1312,12 @@ void popmatrix(std::ostream& stream)
 
 void scale(std::ostream& stream, float x, float y)
 {
-    stream << x << ' ' << y << " scale\n";
+    stream << number(x) << ' ' << number(y) << " scale\n";
 }
 
 void rotate(std::ostream& stream, float angle)
 {
-    stream << angle << " rotate\n";
+    stream << number(angle) << " rotate\n";
 }
 
 void concat(std::ostream& stream, transformation_t t)
@@ -543,20 +1474,355 @@ std::string multi_line_listing(float width, std::string const& in, char delim_ch
 
 /////////////////////////////////////////////
 
-using properties_mem_mgr_t = std::set<eps::properties_override_t>;
-static properties_mem_mgr_t properties_mem_mgr;
-properties_mem_mgr_t& get_mem_mgr()
+// Interning table of the property overrides of one canvas. Overrides are
+// spread over shards by hash, each with its own lock, so shapes of the
+// same canvas can be styled from several threads. The reference counts of
+// the overrides are only touched under the lock of their shard.
+class properties_table_t
+{
+public:
+    properties_override_t const* intern(properties_override_t const& properties_override)
+    {
+        size_t h = hash_t()(properties_override);
+        shard_t& shard = m_shards[h % number_of_shards];
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        std::pair<set_t::iterator, bool> ret = shard.m_set.insert(properties_override);
+        if (ret.second)
+        {
+            ret.first->m_ref_count = 0;
+        }
+        ++ret.first->m_ref_count;
+        return &*ret.first;
+    }
+    void copy(properties_override_t const* p, properties_override_t& properties_override)
+    {
+        shard_t& shard = shard_of(*p);
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        properties_override = *p;
+    }
+    void acquire(properties_override_t const* p)
+    {
+        shard_t& shard = shard_of(*p);
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        ++p->m_ref_count;
+    }
+    // erased(p) is called before an override that is no longer used is
+    // erased, while no other one can take its address.
+    template<typename F>
+    void release(properties_override_t const* p, F erased)
+    {
+        shard_t& shard = shard_of(*p);
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        if (p->m_ref_count > 0)
+        {
+            --p->m_ref_count;
+        }
+        if (!p->m_ref_count)
+        {
+            erased(p);
+            shard.m_set.erase(*p);
+        }
+    }
+    template<typename F>
+    void for_each(F f)
+    {
+        for (shard_t& shard : m_shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.m_mutex);
+            for (properties_override_t const& p : shard.m_set)
+            {
+                f(p);
+            }
+        }
+    }
+private:
+    // Unset properties hash as a fixed value, so equal overrides (by
+    // operator<) hash equal.
+    struct hash_t
+    {
+        size_t operator()(properties_override_t const& p) const
+        {
+            float const unset = std::numeric_limits<float>::quiet_NaN();
+            size_t h = 0;
+            auto combine = [&h](size_t v) { h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2); };
+            auto real = [](float v) { return std::hash<float>()(v + 0.0f); }; // -0 == +0
+            combine(real(p.linewidth(unset)));
+            combine(real(p.linercolor(unset)));
+            combine(real(p.linegcolor(unset)));
+            combine(real(p.linebcolor(unset)));
+            combine(real(p.fillrcolor(unset)));
+            combine(real(p.fillgcolor(unset)));
+            combine(real(p.fillbcolor(unset)));
+            combine(static_cast<size_t>(p.linecap(static_cast<cap_t>(-1))));
+            combine(static_cast<size_t>(p.linejoin(static_cast<join_t>(-1))));
+            combine(real(p.miterlimit(unset)));
+            combine(real(p.epsilon(unset)));
+            combine(std::hash<void const*>()(p.lineend(nullptr)));
+            combine(std::hash<void const*>()(p.linebegin(nullptr)));
+            combine(std::hash<void const*>()(p.linestyle(nullptr)));
+            return h;
+        }
+    };
+    struct equal_t
+    {
+        bool operator()(properties_override_t const& a, properties_override_t const& b) const
+        {
+            return !(a < b) && !(b < a);
+        }
+    };
+    using set_t = std::unordered_set<properties_override_t, hash_t, equal_t>;
+    struct shard_t
+    {
+        std::mutex m_mutex;
+        set_t m_set;
+    };
+    static size_t const number_of_shards = 16;
+    shard_t& shard_of(properties_override_t const& p)
+    {
+        return m_shards[hash_t()(p) % number_of_shards];
+    }
+    std::array<shard_t, number_of_shards> m_shards;
+};
+
+// The resolved styles of one context. Both are interned, so the resolution
+// of a (parent style, override) pair does not change: it is cached until
+// the override is erased. A resolved style lives as long as a pair has it
+// as parent or as result; the ones interned directly, such as the root
+// style, live as long as the context. The address of an erased style may be
+// reused, so what outlives a shape does not keep pointers to styles: the
+// emission cache keeps a copy, and a streaming canvas forgets the style its
+// graphics state was set up for.
+class resolved_styles_t
+{
+public:
+    resolved_style_t const* intern(resolved_style_t const& style)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        styles_t::value_type& interned = *m_styles.try_emplace(style).first;
+        interned.second.m_interned = true;
+        return &interned.first;
+    }
+    resolved_style_t const* resolve(resolved_style_t const* parent, properties_override_t const* properties_override)
+    {
+        if (!properties_override)
+        {
+            return parent;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        resolved_style_t const*& style = m_pairs[pair_t(parent, properties_override)];
+        if (!style)
+        {
+            styles_t::value_type& resolved = *m_styles.try_emplace(resolved_style_t(*parent, *properties_override)).first;
+            ++resolved.second.m_pairs;
+            ++m_styles.find(*parent)->second.m_pairs;
+            style = &resolved.first;
+            m_parents[properties_override].push_back(parent);
+        }
+        return style;
+    }
+    // Drops the pairs of an override that is erased, its address may be
+    // reused for another one, and the styles that no pair has any more.
+    void forget(properties_override_t const* properties_override)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto parents = m_parents.find(properties_override);
+        if (parents == m_parents.end())
+        {
+            return;
+        }
+        for (resolved_style_t const* parent : parents->second)
+        {
+            auto pair = m_pairs.find(pair_t(parent, properties_override));
+            resolved_style_t const* style = pair->second;
+            m_pairs.erase(pair);
+            release(style);
+            release(parent);
+        }
+        m_parents.erase(parents);
+    }
+private:
+    void release(resolved_style_t const* style)
+    {
+        auto i = m_styles.find(*style);
+        if (!--i->second.m_pairs && !i->second.m_interned)
+        {
+            m_styles.erase(i);
+        }
+    }
+    struct hash_t
+    {
+        size_t operator()(resolved_style_t const& style) const
+        {
+            size_t h = 0;
+            auto combine = [&h](size_t v) { h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2); };
+#define P(TYPE, NAME) combine(std::hash<TYPE>()(style.m_##NAME));
+            RESOLVED_STYLE_PROPERTIES
+#undef P
+            return h;
+        }
+    };
+    using pair_t = std::pair<resolved_style_t const*, properties_override_t const*>;
+    struct pair_hash_t
+    {
+        size_t operator()(pair_t const& pair) const
+        {
+            return std::hash<void const*>()(pair.first) * 31 + std::hash<void const*>()(pair.second);
+        }
+    };
+    struct uses_t
+    {
+        size_t m_pairs = 0;
+        bool m_interned = false;
+    };
+    using styles_t = std::unordered_map<resolved_style_t, uses_t, hash_t>;
+    std::mutex m_mutex;
+    styles_t m_styles;
+    std::unordered_map<pair_t, resolved_style_t const*, pair_hash_t> m_pairs;
+    std::unordered_map<properties_override_t const*, std::vector<resolved_style_t const*>> m_parents;
+};
+#undef RESOLVED_STYLE_PROPERTIES
+
+// A monotonic arena for the shapes of a canvas and their storage. Nothing
+// is freed before the arena goes, all at once. Allocation is locked, as the
+// shapes of one canvas may be built on several threads. The destructors of
+// the shapes still run, except for the ones that hold nothing outside the
+// arena, see group_t::~group_t().
+class arena_t
+    : public std::pmr::memory_resource
+{
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_resource.allocate(bytes, alignment);
+    }
+    void do_deallocate(void*, size_t, size_t) override
+    {}
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+    std::mutex m_mutex;
+    std::pmr::monotonic_buffer_resource m_resource{ 1 << 20 };
+};
+
+// Everything the shapes of one canvas share: the interned property
+// overrides and their resolved styles, the root properties, the line
+// ending procedures already written and the memory resource for shapes.
+// Each canvas owns its own context, so different canvases can be built and
+// drawn on different threads.
+class context_t
+{
+public:
+    struct root_properties_t
+        : public graphicsstate_t
+    {
+        root_properties_t(context_t& context)
+            : m_context(context)
+        {}
+        context_t* context() const override
+        {
+            return &m_context;
+        }
+        // The root properties are never set, their style is interned once.
+        resolved_style_t const* resolved_style() const override
+        {
+            resolved_style_t const* style = m_style.load(std::memory_order_acquire);
+            if (!style)
+            {
+                style = iproperties_t::resolved_style();
+                m_style.store(style, std::memory_order_release);
+            }
+            return style;
+        }
+        context_t& m_context;
+        mutable std::atomic<resolved_style_t const*> m_style{ nullptr };
+    };
+    context_t()
+        : m_root_properties(*this)
+    {}
+    context_t(context_t const&) = delete;
+    context_t& operator=(context_t const&) = delete;
+    root_properties_t m_root_properties;
+    properties_table_t m_properties;
+    resolved_styles_t m_resolved_styles;
+    std::set<lineending_t const*> m_procedures;
+    std::unique_ptr<arena_t> m_arena;
+    std::pmr::memory_resource* m_resource = std::pmr::get_default_resource();
+    // The canvas is torn down: its properties table goes as a whole, the
+    // shapes do not release their overrides one by one.
+    bool m_closing = false;
+    // Groups with producers, see group_t::producer().
+    std::mutex m_staging_mutex;
+    std::set<group_t*> m_staged;
+    // Moves the shapes of all producers into their groups.
+    void merge_staged()
+    {
+        std::vector<group_t*> staged;
+        {
+            std::lock_guard<std::mutex> lock(m_staging_mutex);
+            staged.assign(m_staged.begin(), m_staged.end());
+        }
+        for (group_t* group : staged)
+        {
+            group->merge();
+        }
+    }
+};
+
+// Shapes whose parent does not belong to a canvas share this one; they are
+// not meant to be used from more than one thread.
+context_t& default_context()
+{
+    static context_t context;
+    return context;
+}
+
+context_t* iproperties_t::context() const
+{
+    return nullptr;
+}
+
+resolved_style_t const* iproperties_t::resolved_style() const
 {
-    return properties_mem_mgr;
+    context_t* context = this->context();
+    return (context ? *context : default_context()).m_resolved_styles.intern(resolved_style_t(*this));
 }
 
+// What a shape wrote the last time it was drawn, and what that depended
+// on besides the shape itself. See shape_t::draw_cached().
+struct emission_t
+{
+    bool m_dirty = true;
+    std::optional<resolved_style_t> m_style; // a copy, see resolved_styles_t
+    std::array<long, 3> m_settings{}; // precision, simplify and encoding
+    bool m_has_viewport = false;
+    area_t m_viewport;
+    graphicsstate_t m_before;
+    graphicsstate_t m_after;
+    std::array<long, number_of_chunk_counters> m_counters{};
+    std::string m_bytes;
+};
+
 shape_t::shape_t(iproperties_t const& parent_properties)
     : m_parent_properties(parent_properties)
+    , m_context(parent_properties.context() ? parent_properties.context() : &default_context())
     , m_pproperties_override(nullptr)
+    , m_bounding_box(null_bounding_box())
+    , m_bounding_box_epsilon(std::numeric_limits<float>::quiet_NaN())
+    , m_owner(nullptr)
+    , m_resolved_style(nullptr)
+    , m_resolved_parent(nullptr)
 {}
 shape_t::shape_t(shape_t const& other)
     : m_parent_properties(other.m_parent_properties)
+    , m_context(other.m_context)
     , m_pproperties_override(other.m_pproperties_override)
+    , m_bounding_box(other.m_bounding_box)
+    , m_bounding_box_epsilon(other.m_bounding_box_epsilon)
+    , m_owner(nullptr)
+    , m_resolved_style(nullptr)
+    , m_resolved_parent(nullptr)
 {
     inc_ref();
 }
@@ -565,6 +1831,186 @@ shape_t::~shape_t()
     dec_ref();
 }
 
+context_t* shape_t::context() const
+{
+    return m_context;
+}
+
+std::pmr::memory_resource* shape_t::resource() const
+{
+    return m_context->m_resource;
+}
+
+// Every shape is preceded by the resource it came from and its size, so
+// that delete can hand it back. Shapes from the global heap come from
+// std::pmr::new_delete_resource(), allocation and deallocation always
+// pair through a memory resource.
+namespace // anonymous
+{
+
+struct allocation_t
+{
+    std::pmr::memory_resource* m_resource;
+    size_t m_size;
+};
+size_t const allocation_size = (sizeof(allocation_t) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+// The resource a shape that was made with new came from.
+std::pmr::memory_resource* allocated_from(shape_t const& shape)
+{
+    void const* p = static_cast<char const*>(dynamic_cast<void const*>(&shape)) - allocation_size;
+    return static_cast<allocation_t const*>(p)->m_resource;
+}
+
+void* allocate(size_t size, std::pmr::memory_resource* resource)
+{
+    size_t const n = allocation_size + size;
+    if (!resource)
+    {
+        resource = std::pmr::new_delete_resource();
+    }
+    void* p = resource->allocate(n, alignof(std::max_align_t));
+    new (p) allocation_t{ resource, n };
+    return static_cast<char*>(p) + allocation_size;
+}
+
+}; // namespace anonymous
+
+void* shape_t::operator new(size_t size)
+{
+    return allocate(size, nullptr);
+}
+void* shape_t::operator new(size_t size, std::pmr::memory_resource* resource)
+{
+    return allocate(size, resource);
+}
+void shape_t::operator delete(void* p)
+{
+    if (!p)
+    {
+        return;
+    }
+    void* base = static_cast<char*>(p) - allocation_size;
+    allocation_t const allocation = *static_cast<allocation_t*>(base);
+    allocation.m_resource->deallocate(base, allocation.m_size, alignof(std::max_align_t));
+}
+void shape_t::operator delete(void* p, std::pmr::memory_resource*)
+{
+    shape_t::operator delete(p);
+}
+
+// Resolved again when the shape's override or its parent's style changed;
+// the parent checks its own the same way, so a change reaches the shapes
+// below it without touching them. The (parent style, override) pair is
+// usually cached. A shape without override has the style of its parent.
+resolved_style_t const* shape_t::resolved_style() const
+{
+    resolved_style_t const* parent = m_parent_properties.resolved_style();
+    if (!m_resolved_style || m_resolved_parent != parent)
+    {
+        m_resolved_style = m_context->m_resolved_styles.resolve(parent, m_pproperties_override);
+        m_resolved_parent = parent;
+    }
+    return m_resolved_style;
+}
+
+// A cached bounding box is valid for the epsilon it was computed with; NaN
+// marks it invalid. An owner only holds a valid box if all its shapes do,
+// so walking up can stop at the first invalid owner.
+bool shape_t::is_bounding_box_cached() const
+{
+    return !std::isnan(m_bounding_box_epsilon);
+}
+bool shape_t::is_bounding_box_valid(float epsilon) const
+{
+    return m_bounding_box_epsilon == epsilon;
+}
+void shape_t::cache_bounding_box(area_t const& area, float epsilon)
+{
+    m_bounding_box = area;
+    m_bounding_box_epsilon = epsilon;
+}
+void shape_t::invalidate_bounding_box()
+{
+    shape_changed();
+    for (shape_t* s = this; s && s->is_bounding_box_cached(); s = s->m_owner)
+    {
+        s->m_bounding_box_epsilon = std::numeric_limits<float>::quiet_NaN();
+    }
+}
+// The area is in the coordinates of the content of this shape, each owner
+// on the way up maps it into its own.
+void shape_t::extend_bounding_box(area_t const& area)
+{
+    shape_changed();
+    area_t a = area;
+    for (shape_t* s = this; s && s->is_bounding_box_cached(); s = s->m_owner)
+    {
+        a = s->owner_area(a);
+        min_bounding_box(s->m_bounding_box.m_min, a.m_min);
+        max_bounding_box(s->m_bounding_box.m_max, a.m_max);
+    }
+}
+area_t shape_t::owner_area(area_t const& area) const
+{
+    return area;
+}
+// The spatial indices of the groups above a shape are only valid as long
+// as none of their shapes changed.
+void shape_t::shape_changed()
+{
+    for (shape_t* s = m_owner; s; s = s->m_owner)
+    {
+        s->owned_shape_changed();
+    }
+    invalidate_emission();
+}
+void shape_t::owned_shape_changed()
+{
+}
+// What a shape writes changes with it, and so does what its owners write.
+void shape_t::invalidate_emission()
+{
+    for (shape_t* s = this; s; s = s->m_owner)
+    {
+        if (s->m_emission)
+        {
+            s->m_emission->m_dirty = true;
+        }
+    }
+}
+void shape_t::apply_bounding_box(transformation_t const& t)
+{
+    shape_changed();
+    if (m_owner)
+    {
+        m_owner->invalidate_bounding_box();
+    }
+    if (!is_bounding_box_cached())
+    {
+        return;
+    }
+    if (t.m_r.m_x.m_y != 0 || t.m_r.m_y.m_x != 0)
+    {
+        // the box of a rotated shape is not the rotated box
+        invalidate_bounding_box();
+        return;
+    }
+    if (m_bounding_box.m_min.m_x > m_bounding_box.m_max.m_x)
+    {
+        return; // empty
+    }
+    point_t a = m_bounding_box.m_min;
+    point_t b = m_bounding_box.m_max;
+    a *= t;
+    b *= t;
+    m_bounding_box = null_bounding_box();
+    min_bounding_box(m_bounding_box.m_min, a);
+    min_bounding_box(m_bounding_box.m_min, b);
+    max_bounding_box(m_bounding_box.m_max, a);
+    max_bounding_box(m_bounding_box.m_max, b);
+}
+
 #define SET_FUNCTION_1(TYPE, NAME) \
 void shape_t::set##NAME(TYPE NAME) \
 { \
@@ -607,12 +2053,79 @@ SET_FUNCTION_1(linestyle_t*, linestyle)
 #undef SET_FUNCTION_1B
 #undef SET_FUNCTION_3
 
+#define STYLE_FUNCTION_1(TYPE, NAME, BIT) \
+style_t& style_t::set##NAME(TYPE NAME) \
+{ \
+    m_properties.set##NAME(NAME); \
+    m_set |= BIT; \
+    return *this; \
+}
+
+#define STYLE_FUNCTION_1B(TYPE, NAME, NAMEB, BIT) \
+style_t& style_t::set##NAME(TYPE NAME) \
+{ \
+    m_properties.set##NAMEB(NAME, NAME, NAME); \
+    m_set |= BIT; \
+    return *this; \
+}
+
+#define STYLE_FUNCTION_3(TYPE, NAME, NAME1, NAME2, NAME3, BIT) \
+style_t& style_t::set##NAME(TYPE NAME1, TYPE NAME2, TYPE NAME3) \
+{ \
+    m_properties.set##NAME(NAME1, NAME2, NAME3); \
+    m_set |= BIT; \
+    return *this; \
+}
+STYLE_FUNCTION_1(float, linewidth, linewidth_bit)
+STYLE_FUNCTION_1B(float, linegray, linergbcolor, linecolor_bit)
+STYLE_FUNCTION_3(float, linergbcolor, linercolor, linegcolor, linebcolor, linecolor_bit)
+STYLE_FUNCTION_1B(float, fillgray, fillrgbcolor, fillcolor_bit)
+STYLE_FUNCTION_3(float, fillrgbcolor, fillrcolor, fillgcolor, fillbcolor, fillcolor_bit)
+STYLE_FUNCTION_1(cap_t, linecap, linecap_bit)
+STYLE_FUNCTION_1(join_t, linejoin, linejoin_bit)
+STYLE_FUNCTION_1(float, miterlimit, miterlimit_bit)
+STYLE_FUNCTION_1(float, epsilon, epsilon_bit)
+STYLE_FUNCTION_1(lineending_t*, lineend, lineend_bit)
+STYLE_FUNCTION_1(lineending_t*, linebegin, linebegin_bit)
+STYLE_FUNCTION_1(linestyle_t*, linestyle, linestyle_bit)
+#undef STYLE_FUNCTION_1
+#undef STYLE_FUNCTION_1B
+#undef STYLE_FUNCTION_3
+
+// Copies the properties set in this style over the given override.
+void style_t::apply(properties_override_t& properties_override) const
+{
+    if (m_set & linewidth_bit) properties_override.setlinewidth(m_properties.linewidth(0));
+    if (m_set & linecolor_bit) properties_override.setlinergbcolor(m_properties.linercolor(0), m_properties.linegcolor(0), m_properties.linebcolor(0));
+    if (m_set & fillcolor_bit) properties_override.setfillrgbcolor(m_properties.fillrcolor(0), m_properties.fillgcolor(0), m_properties.fillbcolor(0));
+    if (m_set & linecap_bit) properties_override.setlinecap(m_properties.linecap(cap_t::butt));
+    if (m_set & linejoin_bit) properties_override.setlinejoin(m_properties.linejoin(join_t::miter));
+    if (m_set & miterlimit_bit) properties_override.setmiterlimit(m_properties.miterlimit(0));
+    if (m_set & epsilon_bit) properties_override.setepsilon(m_properties.epsilon(0));
+    if (m_set & lineend_bit) properties_override.setlineend(m_properties.lineend(nullptr));
+    if (m_set & linebegin_bit) properties_override.setlinebegin(m_properties.linebegin(nullptr));
+    if (m_set & linestyle_bit) properties_override.setlinestyle(m_properties.linestyle(nullptr));
+}
+
+// Sets all properties of the style with a single interning lookup. A shape
+// without an override of its own adopts the style as is.
+void shape_t::setstyle(style_t const& style)
+{
+    if (!m_pproperties_override)
+    {
+        add(style.m_properties);
+        return;
+    }
+    properties_override_t properties_override;
+    get(properties_override);
+    style.apply(properties_override);
+    add(properties_override);
+}
+
 #define GET_FUNCTION_1(TYPE, NAME) \
 TYPE shape_t::NAME() const \
 { \
-    return m_pproperties_override ? \
-    m_pproperties_override->NAME(m_parent_properties.NAME()) : \
-    m_parent_properties.NAME(); \
+    return resolved_style()->m_##NAME; \
 }
 GET_FUNCTION_1(float, linewidth)
 GET_FUNCTION_1(float, linercolor)
@@ -636,7 +2149,7 @@ void shape_t::inc_ref()
     {
         return;
     }
-    ++m_pproperties_override->m_ref_count;
+    m_context->m_properties.acquire(m_pproperties_override);
 }
 void shape_t::dec_ref()
 {
@@ -644,115 +2157,1797 @@ void shape_t::dec_ref()
     {
         return;
     }
-    if (m_pproperties_override->m_ref_count > 0)
-    {
-        --m_pproperties_override->m_ref_count;
-    }
-    if (!m_pproperties_override->m_ref_count)
+    if (m_context->m_closing)
     {
-        get_mem_mgr().erase(*m_pproperties_override);
+        m_pproperties_override = nullptr;
+        return;
     }
+    context_t* context = m_context;
+    m_context->m_properties.release(m_pproperties_override,
+        [context](properties_override_t const* p) { context->m_resolved_styles.forget(p); });
     m_pproperties_override = nullptr;
 }
-void shape_t::get(properties_override_t& properties_override)
+void shape_t::get(properties_override_t& properties_override) const
 {
     if (!m_pproperties_override)
     {
         return;
     }
-    properties_override = *m_pproperties_override;
-    dec_ref();
+    m_context->m_properties.copy(m_pproperties_override, properties_override);
 }
-void shape_t::add(properties_override_t& properties_override)
+// The new override is interned before the old one is released, so setting
+// a property to its current value neither erases nor reallocates.
+void shape_t::add(properties_override_t const& properties_override)
 {
-    std::pair<properties_mem_mgr_t::iterator, bool> ret =
-        get_mem_mgr().insert(properties_override);
-    m_pproperties_override = &*(ret.first);
-    inc_ref();
+    properties_override_t const* p = m_context->m_properties.intern(properties_override);
+    dec_ref();
+    m_pproperties_override = p;
+    // the style, and with it the painted area, of this shape and the ones
+    // below it changes
+    m_resolved_style = nullptr;
+    shape_changed();
 }
 
 
-void group_t::add(std::unique_ptr<shape_t>&& o)
+// The producers of a group, by id.
+class staging_t
 {
-    m_shapes.push_back(std::move(o));
-}
-
+public:
+    std::map<unsigned, std::unique_ptr<group_t::producer_t>> m_producers;
+};
 
-area_t group_t::bounding_box(float epsilon)
+// Out of line, as the spatial index is only known here.
+group_t::group_t(iproperties_t const& parent_properties)
+    : shape_t(parent_properties)
+{}
+// When the canvas is torn down, the shapes from its arena that hold
+// nothing outside of it are not destroyed: their memory goes with the
+// arena, their overrides with the properties table.
+group_t::~group_t()
 {
-    eps::area_t area = null_bounding_box();
-    for (std::unique_ptr<shape_t> &i : m_shapes)
+    if (m_staging)
+    {
+        std::lock_guard<std::mutex> lock(m_context->m_staging_mutex);
+        m_context->m_staged.erase(this);
+    }
+    std::pmr::memory_resource const* arena = m_context->m_arena.get();
+    if (m_context->m_closing && arena)
+    {
+        for (std::unique_ptr<shape_t>& s : m_shapes)
+        {
+            if (!s->m_emission && allocated_from(*s) == arena && s->releasable(arena))
+            {
+                s.release();
+            }
+        }
+    }
+}
+
+void group_t::producer_t::add(std::unique_ptr<shape_t>&& o)
+{
+    m_shapes.push_back(std::move(o));
+}
+
+// Threads that build shapes for the same group each add them to their own
+// producer, without any locking; a producer must only be used by one
+// thread at a time. The shapes are added to the group by merge(),
+// producer by producer in the order of their ids, so the order does not
+// depend on the timing of the threads. The canvas merges all groups when
+// it is drawn, the producers must be done by then.
+group_t::producer_t& group_t::producer(unsigned id)
+{
+    std::lock_guard<std::mutex> lock(m_context->m_staging_mutex);
+    if (!m_staging)
+    {
+        m_staging = std::make_unique<staging_t>();
+        m_context->m_staged.insert(this);
+    }
+    std::unique_ptr<producer_t>& producer = m_staging->m_producers[id];
+    if (!producer)
+    {
+        producer = std::make_unique<producer_t>();
+    }
+    return *producer;
+}
+
+void group_t::merge()
+{
+    if (!m_staging)
+    {
+        return;
+    }
+    for (auto& producer : m_staging->m_producers)
+    {
+        std::vector<std::unique_ptr<shape_t>> shapes;
+        shapes.swap(producer.second->m_shapes);
+        for (std::unique_ptr<shape_t>& o : shapes)
+        {
+            add(std::move(o));
+        }
+    }
+}
+
+void group_t::add(std::unique_ptr<shape_t>&& o)
+{
+    o->m_owner = this;
+    o->shape_changed();
+    if (is_bounding_box_cached())
+    {
+        extend_bounding_box(o->bounding_box(m_bounding_box_epsilon));
+    }
+    m_shapes.push_back(std::move(o));
+}
+
+
+area_t group_t::bounding_box(float epsilon)
+{
+    if (is_bounding_box_valid(epsilon))
+    {
+        return m_bounding_box;
+    }
+    auto reduce = [this, epsilon](size_t first, size_t last)
+    {
+        eps::area_t area = null_bounding_box();
+        for (size_t i = first; i < last; ++i)
+        {
+            eps::area_t shape_area = m_shapes[i]->bounding_box(epsilon);
+            min_bounding_box(area.m_min, shape_area.m_min);
+            max_bounding_box(area.m_max, shape_area.m_max);
+        }
+        return area;
+    };
+    eps::area_t area;
+    size_t const n = m_shapes.size();
+    if (m_threads > 1 && n >= 2 * min_chunk_size)
+    {
+        // min and max do not care about the order, the result is exact
+        std::vector<area_t> areas(std::min<size_t>(n / min_chunk_size, m_threads));
+        parallel_for(m_threads, areas.size(), [&](size_t k)
+        {
+            areas[k] = reduce(n * k / areas.size(), n * (k + 1) / areas.size());
+        });
+        area = null_bounding_box();
+        for (area_t const& a : areas)
+        {
+            min_bounding_box(area.m_min, a.m_min);
+            max_bounding_box(area.m_max, a.m_max);
+        }
+    }
+    else
+    {
+        area = reduce(0, n);
+    }
+    area = owner_area(area);
+    cache_bounding_box(area, epsilon);
+    return area;
+}
+
+area_t group_t::owner_area(area_t const& area) const
+{
+    return m_transformed ? transformed_area(area, m_transformation) : area;
+}
+
+// Whether a shape holds nothing outside the resource, besides its override
+// and emission, so that it may go with the resource without being
+// destroyed.
+bool shape_t::releasable(std::pmr::memory_resource const*) const
+{
+    return false;
+}
+
+bool shape_t::draw_geometry(std::ostream&, point_t&, float) const
+{
+    return false;
+}
+
+void shape_t::paint(std::ostream&, graphicsstate_t&) const
+{}
+
+float shape_t::painted_margin() const
+{
+    return stroke_margin(*this);
+}
+
+// The shapes of a group paint in its coordinates; a transformation scales
+// their margin, at most by the width of the transformed square.
+float group_t::painted_margin() const
+{
+    float margin = 0.f;
+    for (std::unique_ptr<shape_t> const& s : m_shapes)
+    {
+        margin = std::max(margin, s->painted_margin());
+    }
+    if (m_transformed && margin > 0.f)
+    {
+        area_t const square = transformed_area(area_t(point_t(0.f, 0.f), point_t(margin, margin)), m_transformation);
+        margin = std::max(square.m_max.m_x - square.m_min.m_x, square.m_max.m_y - square.m_min.m_y);
+    }
+    return margin;
+}
+
+// Geometry that several shapes share is defined once as a procedure that
+// each of them calls at its own origin. Off by default: these shapes are
+// drawn past the emission cache, and the geometry of every shape is written
+// once more to find the repeated ones.
+void group_t::setinstancing(bool instancing)
+{
+    m_instancing = instancing;
+    invalidate_emission();
+}
+
+void group_t::setreorder(bool reorder)
+{
+    m_reorder = reorder;
+    invalidate_emission();
+}
+
+// Bounding boxes and drawing of large groups are split over up to threads
+// threads, the output stays the same as with one.
+void group_t::setparallel(unsigned threads)
+{
+    m_threads = std::max(threads, 1u);
+}
+
+void group_t::setindexing(bool indexing)
+{
+    m_indexing = indexing;
+    m_index.reset();
+}
+
+void group_t::owned_shape_changed()
+{
+    m_index.reset();
+}
+
+// The shapes that may paint into the area, see find(): their bounding box
+// widened by their stroke margin intersects it.
+std::vector<shape_t*> group_t::intersecting(area_t const& area, float epsilon) const
+{
+    std::vector<size_t> indices;
+    find(m_transformed ? transformed_area(area, ~m_transformation) : area, epsilon, indices);
+    std::vector<shape_t*> shapes;
+    shapes.reserve(indices.size());
+    for (size_t i : indices)
+    {
+        shapes.push_back(m_shapes[i].get());
+    }
+    return shapes;
+}
+
+// A bounding volume hierarchy over the painted areas of the shapes of a
+// group, built by splitting at the median of the longer axis. The group
+// builds it on first use and rebuilds it once its shapes, their geometry
+// or their properties changed.
+class spatial_index_t
+{
+public:
+    spatial_index_t(std::vector<std::unique_ptr<shape_t>> const& shapes, float epsilon, resolved_style_t const& style)
+        : m_epsilon(epsilon)
+        , m_style(style)
+        , m_indices(shapes.size())
+        , m_areas(shapes.size())
+    {
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            m_areas[i] = painted_area(*shapes[i], epsilon);
+            m_indices[i] = i;
+        }
+        if (!m_indices.empty())
+        {
+            m_nodes.push_back(node_t());
+            build(m_areas, 0, m_indices.size(), 0);
+        }
+    }
+    // The group drops its index when one of its shapes changes; a style
+    // the shapes inherit shows in the group's own style.
+    bool is_valid(size_t size, float epsilon, resolved_style_t const& style) const
+    {
+        return m_indices.size() == size && m_epsilon == epsilon && m_style == style;
+    }
+    // Appends the indices of the shapes whose box intersects the area, in
+    // no particular order.
+    void query(area_t const& area, std::vector<size_t>& indices) const
+    {
+        std::vector<uint32_t> stack;
+        if (!m_nodes.empty())
+        {
+            stack.push_back(0);
+        }
+        while (!stack.empty())
+        {
+            node_t const& node = m_nodes[stack.back()];
+            stack.pop_back();
+            if (!intersects(node.m_area, area))
+            {
+                continue;
+            }
+            if (node.m_count)
+            {
+                for (uint32_t i = node.m_first; i < node.m_first + node.m_count; ++i)
+                {
+                    if (intersects(m_areas[m_indices[i]], area))
+                    {
+                        indices.push_back(m_indices[i]);
+                    }
+                }
+                continue;
+            }
+            stack.push_back(node.m_first);
+            stack.push_back(node.m_first + 1);
+        }
+    }
+private:
+    // A leaf holds m_count shapes from m_indices[m_first] on, an inner node
+    // has m_count 0 and its two children at m_first and m_first + 1.
+    struct node_t
+    {
+        area_t m_area;
+        uint32_t m_first;
+        uint32_t m_count;
+    };
+    static size_t const leaf_size = 8;
+    void build(std::vector<area_t> const& areas, size_t first, size_t last, uint32_t n)
+    {
+        area_t area = null_bounding_box();
+        for (size_t i = first; i < last; ++i)
+        {
+            min_bounding_box(area.m_min, areas[m_indices[i]].m_min);
+            max_bounding_box(area.m_max, areas[m_indices[i]].m_max);
+        }
+        m_nodes[n].m_area = area;
+        if (last - first <= leaf_size)
+        {
+            m_nodes[n].m_first = static_cast<uint32_t>(first);
+            m_nodes[n].m_count = static_cast<uint32_t>(last - first);
+            return;
+        }
+        bool const by_x = area.m_max.m_x - area.m_min.m_x >= area.m_max.m_y - area.m_min.m_y;
+        size_t const middle = first + (last - first) / 2;
+        std::nth_element(m_indices.begin() + first, m_indices.begin() + middle, m_indices.begin() + last,
+            [&areas, by_x](size_t a, size_t b)
+            {
+                return by_x ?
+                    areas[a].m_min.m_x + areas[a].m_max.m_x < areas[b].m_min.m_x + areas[b].m_max.m_x :
+                    areas[a].m_min.m_y + areas[a].m_max.m_y < areas[b].m_min.m_y + areas[b].m_max.m_y;
+            });
+        uint32_t const children = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.resize(m_nodes.size() + 2);
+        m_nodes[n].m_first = children;
+        m_nodes[n].m_count = 0;
+        build(areas, first, middle, children);
+        build(areas, middle, last, children + 1);
+    }
+    float m_epsilon;
+    resolved_style_t m_style; // a copy, see resolved_styles_t
+    std::vector<size_t> m_indices;
+    std::vector<area_t> m_areas;
+    std::vector<node_t> m_nodes;
+};
+
+namespace // anonymous
+{
+
+// Orders the shapes so that shapes with the same resolved style follow each
+// other. Only shapes whose painted areas overlap can tell the painter's
+// order, those keep their relative order; the painted area is the bounding
+// box widened by the stroke margin, so touching thick strokes overlap.
+// From the shapes that are free to go next the current style is
+// preferred, then the lowest index. The order holds the indices of the
+// shapes to draw, ascending, and is reordered in place. Returns the number of style changes saved, 0 leaves
+// the order as it was.
+size_t style_order(std::vector<std::unique_ptr<shape_t>> const& shapes, float epsilon, std::vector<size_t>& order)
+{
+    size_t const n = order.size();
+    std::vector<size_t> const indices(order);
+    std::vector<size_t> positions(n);
+    std::iota(positions.begin(), positions.end(), 0);
+    std::vector<resolved_style_t const*> styles(n);
+    std::vector<area_t> areas(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        styles[i] = shapes[indices[i]]->resolved_style();
+        areas[i] = painted_area(*shapes[indices[i]], epsilon);
+    }
+    auto style_changes = [&styles](std::vector<size_t> const& o)
+    {
+        size_t changes = 0;
+        for (size_t k = 1; k < o.size(); ++k)
+        {
+            changes += styles[o[k]] != styles[o[k - 1]];
+        }
+        return changes;
+    };
+    size_t const before = style_changes(positions);
+    if (before < 2)
+    {
+        return 0;
+    }
+
+    // overlapping pairs by a sweep over x; give up on heavily overlapping
+    // groups rather than spend quadratic time on them
+    std::vector<size_t> by_x(positions);
+    std::sort(by_x.begin(), by_x.end(), [&areas](size_t a, size_t b) { return areas[a].m_min.m_x < areas[b].m_min.m_x; });
+    std::vector<std::pair<size_t, size_t>> edges;
+    size_t const max_comparisons = 64 * n;
+    size_t comparisons = 0;
+    for (size_t a = 0; a < n; ++a)
+    {
+        area_t const& A = areas[by_x[a]];
+        for (size_t b = a + 1; b < n && areas[by_x[b]].m_min.m_x <= A.m_max.m_x; ++b)
+        {
+            if (++comparisons > max_comparisons)
+            {
+                return 0;
+            }
+            area_t const& B = areas[by_x[b]];
+            if (B.m_min.m_y <= A.m_max.m_y && A.m_min.m_y <= B.m_max.m_y)
+            {
+                edges.emplace_back(std::min(by_x[a], by_x[b]), std::max(by_x[a], by_x[b]));
+            }
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    std::vector<size_t> first_edge(n + 1, 0);
+    std::vector<size_t> predecessors(n, 0);
+    for (std::pair<size_t, size_t> const& e : edges)
+    {
+        ++first_edge[e.first + 1];
+        ++predecessors[e.second];
+    }
+    std::partial_sum(first_edge.begin(), first_edge.end(), first_edge.begin());
+
+    std::set<size_t> ready;
+    std::unordered_map<resolved_style_t const*, std::set<size_t>> ready_by_style;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (!predecessors[i])
+        {
+            ready.insert(i);
+            ready_by_style[styles[i]].insert(i);
+        }
+    }
+    resolved_style_t const* current = nullptr;
+    for (size_t k = 0; k < n; ++k)
+    {
+        std::unordered_map<resolved_style_t const*, std::set<size_t>>::iterator same = ready_by_style.find(current);
+        size_t i = same != ready_by_style.end() && !same->second.empty() ? *same->second.begin() : *ready.begin();
+        current = styles[i];
+        ready.erase(i);
+        ready_by_style[current].erase(i);
+        positions[k] = i;
+        for (size_t e = first_edge[i]; e < first_edge[i + 1]; ++e)
+        {
+            size_t j = edges[e].second;
+            if (!--predecessors[j])
+            {
+                ready.insert(j);
+                ready_by_style[styles[j]].insert(j);
+            }
+        }
+    }
+    size_t const after = style_changes(positions);
+    if (after >= before)
+    {
+        return 0;
+    }
+    for (size_t k = 0; k < n; ++k)
+    {
+        order[k] = indices[positions[k]];
+    }
+    return before - after;
+}
+
+// Geometry that is written shorter than this is not worth a procedure call.
+size_t const min_geometry_size = 32;
+
+// Writes the geometry of a shape relative to its origin, for an instance
+// procedure. The relative coordinates get no more decimals than the
+// absolute ones would, which drops the float noise of the subtraction:
+// equal shapes at other places write the same text.
+bool draw_relative_geometry(eps::shape_t& shape, std::ostream& stream, eps::point_t& origin, float epsilon)
+{
+    eps::area_t const area = shape.bounding_box(epsilon);
+    float const magnitude = std::max({ std::fabs(area.m_min.m_x), std::fabs(area.m_min.m_y),
+        std::fabs(area.m_max.m_x), std::fabs(area.m_max.m_y), 1.f });
+    // the default precision writes 6 significant digits
+    long decimals = std::max(5 - static_cast<long>(std::floor(std::log10(magnitude))), 0L);
+    long const precision = stream.iword(precision_index);
+    if (precision > 0)
+    {
+        decimals = std::min(decimals, precision - 1);
+    }
+    stream.iword(precision_index) = decimals + 1;
+    bool const drawn = shape.draw_geometry(stream, origin, epsilon);
+    stream.iword(precision_index) = precision;
+    return drawn;
+}
+
+// Repeated geometry is recognized by the hash and the length of its text,
+// the text itself is not kept; the shape that defines the procedure writes
+// it again.
+struct geometry_key_t
+{
+    geometry_key_t()
+        : m_hash(0)
+        , m_size(0)
+    {}
+    geometry_key_t(char const* data, size_t size)
+        : m_hash(std::hash<std::string_view>()(std::string_view(data, size)))
+        , m_size(size)
+    {}
+    bool operator==(geometry_key_t const& other) const
+    {
+        return m_hash == other.m_hash && m_size == other.m_size;
+    }
+    struct hash_t
+    {
+        size_t operator()(geometry_key_t const& key) const
+        {
+            return key.m_hash;
+        }
+    };
+    size_t m_hash;
+    size_t m_size; // 0: no instance
+};
+
+// Whether a shape may be drawn through an instance procedure. Shapes that
+// reach outside the viewport are drawn themselves, so that they are
+// clipped to it.
+bool instanceable(eps::shape_t& shape, std::ostream& stream, float epsilon)
+{
+    eps::area_t const* area = eps::viewport(stream);
+    return !area || contains(*area, painted_area(shape, epsilon));
+}
+
+// A chunk of a group that is drawn in parallel is first drawn from a
+// graphics state in which every property is unknown. Shapes that set a
+// property leave its known value behind and write it whatever it was
+// before, so the state after the chunk follows from the state before it.
+// Only the shapes that wrote an operator for a property that was still
+// unknown can come out different from the real start state, these are
+// drawn again once it is known, as are the shapes that write unique names.
+// Line and fill color are one PostScript color, the graphics state always
+// keeps them equal.
+lineending_none_t l_lineending_unknown;
+linestyle_none_t l_linestyle_unknown;
+
+bool is_unknown(float v) { return std::isnan(v); }
+bool is_unknown(cap_t v) { return v == static_cast<cap_t>(-1); }
+bool is_unknown(join_t v) { return v == static_cast<join_t>(-1); }
+bool is_unknown(lineending_t* v) { return v == &l_lineending_unknown; }
+bool is_unknown(linestyle_t* v) { return v == &l_linestyle_unknown; }
+
+#define CHUNK_STATE_PROPERTIES \
+    P(linewidth, std::numeric_limits<float>::quiet_NaN()) \
+    P(linercolor, std::numeric_limits<float>::quiet_NaN()) \
+    P(linegcolor, std::numeric_limits<float>::quiet_NaN()) \
+    P(linebcolor, std::numeric_limits<float>::quiet_NaN()) \
+    P(fillrcolor, std::numeric_limits<float>::quiet_NaN()) \
+    P(fillgcolor, std::numeric_limits<float>::quiet_NaN()) \
+    P(fillbcolor, std::numeric_limits<float>::quiet_NaN()) \
+    P(linecap, static_cast<cap_t>(-1)) \
+    P(linejoin, static_cast<join_t>(-1)) \
+    P(miterlimit, std::numeric_limits<float>::quiet_NaN()) \
+    P(lineend, &l_lineending_unknown) \
+    P(linebegin, &l_lineending_unknown) \
+    P(linestyle, &l_linestyle_unknown)
+
+graphicsstate_t unknown_state(graphicsstate_t const& graphicsstate)
+{
+    graphicsstate_t unknown(graphicsstate);
+#define P(NAME, UNKNOWN) unknown.m_##NAME = UNKNOWN;
+    CHUNK_STATE_PROPERTIES
+#undef P
+    unknown.m_stroke_style = unknown.m_fill_style = nullptr;
+    return unknown;
+}
+
+uint32_t known_properties(graphicsstate_t const& graphicsstate)
+{
+    uint32_t known = 0;
+    uint32_t bit = 1;
+#define P(NAME, UNKNOWN) known |= is_unknown(graphicsstate.m_##NAME) ? 0 : bit; bit <<= 1;
+    CHUNK_STATE_PROPERTIES
+#undef P
+    return known;
+}
+
+// The state after a chunk that started from state, where end is the state
+// it left when it started from unknown_state().
+void merge_known(graphicsstate_t& state, graphicsstate_t const& end)
+{
+#define P(NAME, UNKNOWN) if (!is_unknown(end.m_##NAME)) state.m_##NAME = end.m_##NAME;
+    CHUNK_STATE_PROPERTIES
+#undef P
+    state.m_epsilon = end.m_epsilon;
+    state.m_stroke_style = state.m_fill_style = nullptr;
+}
+
+bool same_state(graphicsstate_t const& a, graphicsstate_t const& b)
+{
+#define P(NAME, UNKNOWN) if (a.m_##NAME != b.m_##NAME) return false;
+    CHUNK_STATE_PROPERTIES
+#undef P
+    return a.m_epsilon == b.m_epsilon;
+}
+#undef CHUNK_STATE_PROPERTIES
+
+// Bits of known_properties(), in the order of CHUNK_STATE_PROPERTIES.
+uint32_t const all_properties = (1u << 13) - 1;
+uint32_t const linewidth_property = 1u << 0;
+uint32_t const color_properties = 0x3fu << 1;
+uint32_t const linecap_property = 1u << 7;
+uint32_t const linejoin_property = 1u << 8;
+uint32_t const miterlimit_property = 1u << 9;
+uint32_t const linestyle_property = 1u << 12;
+
+// The properties whose operators are written in the lines from first to
+// last.
+uint32_t written_properties(char const* first, char const* last)
+{
+    uint32_t written = 0;
+    while (first != last)
+    {
+        char const* eol = static_cast<char const*>(std::memchr(first, '\n', last - first));
+        char const* end = eol ? eol : last;
+        char const* op = end;
+        while (op != first && op[-1] != ' ')
+        {
+            --op;
+        }
+        std::string_view const name(op, end - op);
+        if (name.size() > 3 && name.compare(0, 3, "set") == 0)
+        {
+            if (name == "setlinewidth") written |= linewidth_property;
+            else if (name == "setgray" || name == "setrgbcolor" || name == "sethsbcolor" || name == "setcmykcolor") written |= color_properties;
+            else if (name == "setdash") written |= linestyle_property;
+            else if (name == "setlinecap") written |= linecap_property;
+            else if (name == "setlinejoin") written |= linejoin_property;
+            else if (name == "setmiterlimit") written |= miterlimit_property;
+        }
+        first = eol ? eol + 1 : last;
+    }
+    return written;
+}
+
+// Collects what a chunk or a shape writes, so that it can be looked at
+// while drawing. The string is the put area, it doubles when full.
+class string_buffer_t
+    : public std::streambuf
+{
+public:
+    char const* data() const { return pbase(); }
+    size_t size() const { return pptr() - pbase(); }
+    // Starts over empty, keeping the memory.
+    void clear() { setp(pbase(), epptr()); }
+    // What was written, the buffer starts over empty.
+    std::string take()
+    {
+        m_bytes.resize(size());
+        std::string bytes = std::move(m_bytes);
+        m_bytes = std::string();
+        setp(nullptr, nullptr);
+        return bytes;
+    }
+protected:
+    int_type overflow(int_type c) override
+    {
+        size_t n = size();
+        m_bytes.resize(std::max<size_t>(2 * m_bytes.size(), 256));
+        setp(&m_bytes[0], &m_bytes[0] + m_bytes.size());
+        for (; n > INT_MAX; n -= INT_MAX)
+        {
+            pbump(INT_MAX);
+        }
+        pbump(static_cast<int>(n));
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+private:
+    std::string m_bytes;
+};
+
+// A shape whose bytes depend on the start state of its chunk, or on the
+// names taken before it.
+struct unstable_t
+{
+    size_t m_position;
+    size_t m_begin; // of its bytes in the chunk
+    size_t m_end;
+    graphicsstate_t m_before;
+    long m_names; // unique names taken before it
+    std::string m_bytes; // drawn again
+};
+
+struct chunk_t
+{
+    size_t m_first = 0; // positions in the draw order
+    size_t m_last = 0;
+    std::string m_bytes;
+    std::vector<unstable_t> m_unstable;
+    std::array<long, number_of_chunk_counters> m_counters{};
+    std::array<long, number_of_cache_counters> m_cache_counters{};
+    graphicsstate_t m_start;
+    graphicsstate_t m_end;
+    long m_base = 0; // the first unique name number
+    long m_names = 0; // unique names taken
+};
+
+// Points a stream at a capture buffer for as long as it lives, the state
+// of the stream is kept.
+class redirect_t
+{
+public:
+    redirect_t(std::ostream& stream, string_buffer_t* buffer)
+        : m_stream(stream)
+        , m_state(stream.rdstate())
+        , m_buffer(stream.rdbuf(buffer))
+        , m_capture(stream.pword(capture_index))
+    {
+        stream.pword(capture_index) = buffer;
+    }
+    ~redirect_t()
+    {
+        m_stream.rdbuf(m_buffer);
+        m_stream.setstate(m_state);
+        m_stream.pword(capture_index) = m_capture;
+    }
+private:
+    std::ostream& m_stream;
+    std::ios_base::iostate m_state;
+    std::streambuf* m_buffer;
+    void* m_capture;
+};
+
+bool same_area(area_t const& a, area_t const& b)
+{
+    return a.m_min == b.m_min && a.m_max == b.m_max;
+}
+
+// A procedure for repeated geometry is defined by the first shape that
+// uses it, possibly in another chunk. Its name is only known after all
+// chunks before that one.
+struct chunk_instance_t
+{
+    size_t m_count = 0;
+    size_t m_definer = 0; // position
+    size_t m_chunk = 0;
+    long m_local = 0; // name number within the chunk
+    std::string m_name;
+};
+
+}; // namespace anonymous
+
+// With caching on for the stream, see set_caching(), a shape that did not
+// change since it was last drawn, drawn again from the same state with the
+// same style and stream settings, writes a copy of the bytes it wrote then.
+// A shape that takes unique names is always drawn, the names differ.
+void shape_t::draw_cached(std::ostream& stream, eps::graphicsstate_t& graphicsstate) const
+{
+    if (!stream.iword(caching_index))
+    {
+        draw(stream, graphicsstate);
+        return;
+    }
+    resolved_style_t const* style = resolved_style();
+    std::array<long, 3> const settings = { stream.iword(precision_index), stream.iword(simplify_index), stream.iword(encoding_index) };
+    area_t const* area = viewport(stream);
+    emission_t* emission = m_emission.get();
+    if (emission && !emission->m_dirty && *emission->m_style == *style && emission->m_settings == settings &&
+        emission->m_has_viewport == (area != nullptr) && (!area || same_area(*area, emission->m_viewport)) &&
+        same_state(graphicsstate, emission->m_before))
+    {
+        stream.write(emission->m_bytes.data(), emission->m_bytes.size());
+        for (size_t c = 0; c < number_of_chunk_counters; ++c)
+        {
+            stream.iword(chunk_counters[c]) += emission->m_counters[c];
+        }
+        // the styles the state was set up for may be gone
+        resolved_style_t const* stroke_style = graphicsstate.m_stroke_style;
+        resolved_style_t const* fill_style = graphicsstate.m_fill_style;
+        graphicsstate = emission->m_after;
+        graphicsstate.m_stroke_style = emission->m_after.m_stroke_style == emission->m_before.m_stroke_style ? stroke_style : nullptr;
+        graphicsstate.m_fill_style = emission->m_after.m_fill_style == emission->m_before.m_fill_style ? fill_style : nullptr;
+        ++stream.iword(cache_hits_index);
+        stream.iword(cache_reused_index) += static_cast<long>(emission->m_bytes.size());
+        return;
+    }
+    ++stream.iword(cache_misses_index);
+    // Shapes of a group that is captured write straight into its buffer.
+    auto capture = [&](string_buffer_t& buffer)
+    {
+        eps::graphicsstate_t const before = graphicsstate;
+        long const names = stream.iword(instance_index);
+        std::array<long, number_of_chunk_counters> counters;
+        for (size_t c = 0; c < number_of_chunk_counters; ++c)
+        {
+            counters[c] = stream.iword(chunk_counters[c]);
+        }
+        size_t const begin = buffer.size();
+        draw(stream, graphicsstate);
+        if (stream.iword(instance_index) != names)
+        {
+            m_emission.reset();
+            return;
+        }
+        if (!emission)
+        {
+            m_emission = std::make_unique<emission_t>();
+            emission = m_emission.get();
+        }
+        emission->m_style = *style;
+        emission->m_settings = settings;
+        emission->m_has_viewport = area != nullptr;
+        if (area)
+        {
+            emission->m_viewport = *area;
+        }
+        emission->m_before = before;
+        emission->m_after = graphicsstate;
+        for (size_t c = 0; c < number_of_chunk_counters; ++c)
+        {
+            emission->m_counters[c] = stream.iword(chunk_counters[c]) - counters[c];
+        }
+        emission->m_bytes.assign(buffer.data() + begin, buffer.size() - begin);
+        emission->m_dirty = false;
+    };
+    string_buffer_t* captured = static_cast<string_buffer_t*>(stream.pword(capture_index));
+    if (captured && stream.rdbuf() == captured)
+    {
+        capture(*captured);
+        return;
+    }
+    string_buffer_t buffer;
+    {
+        redirect_t redirect(stream, &buffer);
+        capture(buffer);
+    }
+    stream.write(buffer.data(), buffer.size());
+}
+
+// Shapes whose geometry only differs by a translation share one procedure
+// that constructs the path at the origin: "/name { matrix currentmatrix 3 1
+// roll translate ... setmatrix } bind def". Each of them is then drawn as
+// "newpath x y name" followed by its own paint operators.
+// A lazily transformed group concatenates its transformation around its
+// shapes, which see the viewport mapped into their coordinates.
+void group_t::draw(std::ostream& stream, eps::graphicsstate_t& graphicsstate) const
+{
+    if (!m_transformed)
+    {
+        draw_shapes(stream, graphicsstate);
+        return;
+    }
+    area_t const* outer = viewport(stream);
+    area_t inner;
+    if (outer)
+    {
+        inner = transformed_area(*outer, ~m_transformation);
+        stream.pword(viewport_index) = &inner;
+    }
+    pushmatrix(stream);
+    concatmatrix(stream, m_transformation);
+    draw_shapes(stream, graphicsstate);
+    popmatrix(stream);
+    stream.pword(viewport_index) = const_cast<area_t*>(outer);
+}
+
+void group_t::draw_shapes(std::ostream& stream, eps::graphicsstate_t& graphicsstate) const
+{
+    float epsilon = get_epsilon(graphicsstate);
+    std::vector<size_t> order;
+    if (area_t const* area = viewport(stream))
+    {
+        find(*area, epsilon, order);
+    }
+    else
+    {
+        order.resize(m_shapes.size());
+        std::iota(order.begin(), order.end(), 0);
+    }
+    if (m_reorder)
+    {
+        stream.iword(reordered_index) += static_cast<long>(style_order(m_shapes, epsilon, order));
+    }
+    if (m_threads > 1 && order.size() >= 2 * min_chunk_size)
+    {
+        draw_parallel(stream, graphicsstate, order);
+        return;
+    }
+    if (!m_instancing)
+    {
+        for (size_t i : order)
+        {
+            m_shapes[i]->draw_cached(stream, graphicsstate);
+        }
+        return;
+    }
+    struct instance_t
+    {
+        size_t m_count = 0;
+        std::string m_name;
+    };
+    using instances_t = std::unordered_map<geometry_key_t, instance_t, geometry_key_t::hash_t>;
+    instances_t instances;
+    std::vector<instance_t*> shape_instances(m_shapes.size(), nullptr);
+    std::vector<point_t> origins(m_shapes.size());
+    string_buffer_t buffer;
+    std::ostream geometry(&buffer);
+    geometry.copyfmt(stream);
+    for (size_t i : order)
+    {
+        buffer.clear();
+        if (instanceable(*m_shapes[i], stream, epsilon) &&
+            draw_relative_geometry(*m_shapes[i], geometry, origins[i], epsilon) && buffer.size() > min_geometry_size)
+        {
+            instance_t& instance = instances[geometry_key_t(buffer.data(), buffer.size())];
+            ++instance.m_count;
+            shape_instances[i] = &instance;
+        }
+    }
+    for (size_t i : order)
+    {
+        instance_t* instance = shape_instances[i];
+        if (!instance || instance->m_count < 2)
+        {
+            m_shapes[i]->draw_cached(stream, graphicsstate);
+            continue;
+        }
+        if (instance->m_name.empty())
+        {
+            instance->m_name = unique_name(stream, instance_prefix);
+            stream << '/' << instance->m_name << " {\n"
+                << "matrix currentmatrix 3 1 roll translate\n";
+            point_t origin;
+            draw_relative_geometry(*m_shapes[i], stream, origin, epsilon);
+            stream << "setmatrix\n"
+                << "} bind def\n";
+        }
+        new_path(stream);
+        stream << origins[i] << ' ' << instance->m_name << '\n';
+        m_shapes[i]->paint(stream, graphicsstate);
+        if (stream.iword(caching_index))
+        {
+            ++stream.iword(cache_misses_index);
+            ++stream.iword(cache_bypassed_index);
+        }
+    }
+}
+
+// Draws the shapes in chunks on several threads, each into its own buffer,
+// and writes the buffers in order. The bytes are the same as when drawing
+// them one after the other, see chunk_t: the state a chunk starts from,
+// and the names of the procedures it defines, are only known after the
+// chunks before it, so chunks are drawn in two passes.
+void group_t::draw_parallel(std::ostream& stream, eps::graphicsstate_t& graphicsstate, std::vector<size_t> const& order) const
+{
+    float const epsilon = get_epsilon(graphicsstate);
+    size_t const n = order.size();
+    std::vector<chunk_t> chunks(std::min<size_t>(n / min_chunk_size, size_t(m_threads) * 4));
+    for (size_t k = 0; k < chunks.size(); ++k)
     {
-        eps::area_t shape_area = i->bounding_box(epsilon);
-        min_bounding_box(area.m_min, shape_area.m_min);
-        max_bounding_box(area.m_max, shape_area.m_max);
+        chunks[k].m_first = n * k / chunks.size();
+        chunks[k].m_last = n * (k + 1) / chunks.size();
     }
-    return area;
+    // the shapes only read the styles of their parents once these are resolved
+    iproperties_t const* parent = nullptr;
+    for (size_t i : order)
+    {
+        if (&m_shapes[i]->m_parent_properties != parent)
+        {
+            parent = &m_shapes[i]->m_parent_properties;
+            parent->resolved_style();
+        }
+    }
+
+    using instances_t = std::unordered_map<geometry_key_t, chunk_instance_t, geometry_key_t::hash_t>;
+    instances_t instances;
+    std::vector<chunk_instance_t*> shape_instances;
+    std::vector<point_t> origins;
+    if (m_instancing)
+    {
+        std::vector<geometry_key_t> keys(n);
+        origins.resize(m_shapes.size());
+        parallel_for(m_threads, chunks.size(), [&](size_t k)
+        {
+            string_buffer_t buffer;
+            std::ostream geometry(&buffer);
+            geometry.copyfmt(stream);
+            for (size_t pos = chunks[k].m_first; pos < chunks[k].m_last; ++pos)
+            {
+                buffer.clear();
+                shape_t& shape = *m_shapes[order[pos]];
+                if (instanceable(shape, stream, epsilon) &&
+                    draw_relative_geometry(shape, geometry, origins[order[pos]], epsilon) && buffer.size() > min_geometry_size)
+                {
+                    keys[pos] = geometry_key_t(buffer.data(), buffer.size());
+                }
+            }
+        });
+        shape_instances.assign(m_shapes.size(), nullptr);
+        for (size_t k = 0; k < chunks.size(); ++k)
+        {
+            for (size_t pos = chunks[k].m_first; pos < chunks[k].m_last; ++pos)
+            {
+                if (!keys[pos].m_size)
+                {
+                    continue;
+                }
+                chunk_instance_t& instance = instances[keys[pos]];
+                if (!instance.m_count++)
+                {
+                    instance.m_definer = pos;
+                    instance.m_chunk = k;
+                }
+                shape_instances[order[pos]] = &instance;
+            }
+        }
+    }
+
+    // resolved: the procedure names are known, in the first pass they are
+    // not. Returns whether a procedure name was written.
+    auto draw = [&](std::ostream& out, eps::graphicsstate_t& state, size_t pos, bool resolved)
+    {
+        size_t const i = order[pos];
+        chunk_instance_t* instance = shape_instances.empty() ? nullptr : shape_instances[i];
+        if (!instance || instance->m_count < 2)
+        {
+            m_shapes[i]->draw(out, state);
+            return false;
+        }
+        chunk_instance_t& procedure = *instance;
+        std::string name;
+        if (procedure.m_definer == pos)
+        {
+            name = unique_name(out, instance_prefix);
+            if (!resolved)
+            {
+                procedure.m_local = out.iword(instance_index) - 1;
+            }
+            out << '/' << name << " {\n"
+                << "matrix currentmatrix 3 1 roll translate\n";
+            point_t origin;
+            draw_relative_geometry(*m_shapes[i], out, origin, epsilon);
+            out << "setmatrix\n"
+                << "} bind def\n";
+        }
+        if (resolved)
+        {
+            name = procedure.m_name;
+        }
+        new_path(out);
+        out << origins[i] << ' ' << name << '\n';
+        m_shapes[i]->paint(out, state);
+        return true;
+    };
+    auto start = [&stream](std::ostream& out, long base)
+    {
+        out.copyfmt(stream);
+        for (int counter : chunk_counters)
+        {
+            out.iword(counter) = 0;
+        }
+        for (int counter : cache_counters)
+        {
+            out.iword(counter) = 0;
+        }
+        out.iword(instance_index) = base;
+    };
+
+    parallel_for(m_threads, chunks.size(), [&](size_t k)
+    {
+        chunk_t& chunk = chunks[k];
+        string_buffer_t buffer;
+        std::ostream out(&buffer);
+        start(out, 0);
+        eps::graphicsstate_t state = unknown_state(graphicsstate);
+        for (size_t pos = chunk.m_first; pos < chunk.m_last; ++pos)
+        {
+            size_t const begin = buffer.size();
+            eps::graphicsstate_t const before = state;
+            uint32_t const unknown = ~known_properties(state) & all_properties;
+            long const names = out.iword(instance_index);
+            bool const named = draw(out, state, pos, false);
+            if (named || out.iword(instance_index) != names ||
+                (unknown && ((known_properties(state) & unknown) ||
+                    (written_properties(buffer.data() + begin, buffer.data() + buffer.size()) & unknown))))
+            {
+                chunk.m_unstable.push_back(unstable_t{ pos, begin, buffer.size(), before, names, std::string() });
+            }
+        }
+        chunk.m_bytes = buffer.take();
+        chunk.m_end = state;
+        for (size_t c = 0; c < number_of_chunk_counters; ++c)
+        {
+            chunk.m_counters[c] = out.iword(chunk_counters[c]);
+        }
+        for (size_t c = 0; c < number_of_cache_counters; ++c)
+        {
+            chunk.m_cache_counters[c] = out.iword(cache_counters[c]);
+        }
+        chunk.m_names = out.iword(instance_index);
+    });
+
+    eps::graphicsstate_t state = graphicsstate;
+    long names = stream.iword(instance_index);
+    for (chunk_t& chunk : chunks)
+    {
+        chunk.m_start = state;
+        chunk.m_base = names;
+        merge_known(state, chunk.m_end);
+        names += chunk.m_names;
+    }
+    for (instances_t::value_type& instance : instances)
+    {
+        chunk_instance_t& procedure = instance.second;
+        if (procedure.m_count > 1)
+        {
+            procedure.m_name = instance_prefix + std::to_string(chunks[procedure.m_chunk].m_base + procedure.m_local);
+        }
+    }
+
+    parallel_for(m_threads, chunks.size(), [&](size_t k)
+    {
+        chunk_t& chunk = chunks[k];
+        for (unstable_t& unstable : chunk.m_unstable)
+        {
+            string_buffer_t buffer;
+            std::ostream out(&buffer);
+            start(out, chunk.m_base + unstable.m_names);
+            eps::graphicsstate_t s = chunk.m_start;
+            merge_known(s, unstable.m_before);
+            draw(out, s, unstable.m_position, true);
+            unstable.m_bytes = buffer.take();
+        }
+    });
+
+    for (chunk_t const& chunk : chunks)
+    {
+        size_t offset = 0;
+        for (unstable_t const& unstable : chunk.m_unstable)
+        {
+            stream.write(chunk.m_bytes.data() + offset, unstable.m_begin - offset);
+            stream.write(unstable.m_bytes.data(), unstable.m_bytes.size());
+            offset = unstable.m_end;
+        }
+        stream.write(chunk.m_bytes.data() + offset, chunk.m_bytes.size() - offset);
+        for (size_t c = 0; c < number_of_chunk_counters; ++c)
+        {
+            stream.iword(chunk_counters[c]) += chunk.m_counters[c];
+        }
+        for (size_t c = 0; c < number_of_cache_counters; ++c)
+        {
+            stream.iword(cache_counters[c]) += chunk.m_cache_counters[c];
+        }
+    }
+    if (stream.iword(caching_index))
+    {
+        stream.iword(cache_misses_index) += static_cast<long>(n);
+        stream.iword(cache_bypassed_index) += static_cast<long>(n);
+    }
+    stream.iword(instance_index) = names;
+    graphicsstate = state;
 }
 
-void group_t::draw(std::ostream& stream, eps::graphicsstate_t& graphicsstate) const
+// The indices of the shapes whose painted area intersects the area, in
+// insertion order: the bounding box widened by the stroke margin, so a
+// thick stroke just outside the area is found. With indexing on, a
+// spatial index over the areas is built once and reused until a shape
+// changes.
+void group_t::find(area_t const& area, float epsilon, std::vector<size_t>& indices) const
 {
-    for (std::unique_ptr<shape_t> const &i : m_shapes)
+    indices.clear();
+    if (!m_indexing)
     {
-        i->draw(stream, graphicsstate);
+        for (size_t i = 0; i < m_shapes.size(); ++i)
+        {
+            if (intersects(painted_area(*m_shapes[i], epsilon), area))
+            {
+                indices.push_back(i);
+            }
+        }
+        return;
+    }
+    resolved_style_t const& style = *resolved_style();
+    if (!m_index || !m_index->is_valid(m_shapes.size(), epsilon, style))
+    {
+        m_index = std::make_unique<spatial_index_t>(m_shapes, epsilon, style);
     }
+    m_index->query(area, indices);
+    std::sort(indices.begin(), indices.end());
 }
 
+// A group that transforms lazily only composes the transformation with the
+// one it carries, its shapes keep their coordinates. It is drawn as a
+// PostScript coordinate transformation, so scaling also scales line
+// widths and text. Excluding text needs the transformation applied to the
+// shapes themselves.
 void group_t::apply(transformation_t const& t, bool excluding_text)
 {
+    if (m_lazy && !excluding_text)
+    {
+        if (m_transformed)
+        {
+            // the axes are directions, the translation of t does not apply
+            point_t x = point_t(0.f, 0.f) + m_transformation.m_r.m_x;
+            point_t y = point_t(0.f, 0.f) + m_transformation.m_r.m_y;
+            point_t o(0.f, 0.f);
+            x *= t;
+            y *= t;
+            o *= t;
+            m_transformation.m_r.m_x = x - o;
+            m_transformation.m_r.m_y = y - o;
+            m_transformation.m_t *= t;
+        }
+        else
+        {
+            m_transformation = t;
+            m_transformed = true;
+        }
+        apply_bounding_box(t);
+        return;
+    }
+    flatten();
     for (std::unique_ptr<shape_t> &i : m_shapes)
     {
         i->apply(t, excluding_text);
     }
+    apply_bounding_box(t);
+}
+
+void group_t::setlazytransform(bool lazy)
+{
+    m_lazy = lazy;
+    if (!m_lazy)
+    {
+        flatten();
+    }
+}
+
+// Applies the carried transformation to the shapes.
+void group_t::flatten()
+{
+    if (!m_transformed)
+    {
+        return;
+    }
+    m_transformed = false;
+    for (std::unique_ptr<shape_t> &i : m_shapes)
+    {
+        i->apply(m_transformation, false);
+    }
 }
 
+// The context is a base in front of canvas_t, so that it is constructed
+// before and destroyed after all the shapes that refer to it.
 struct canvas_impl_t
-    : public eps::canvas_t
+    : private context_t
+    , public eps::canvas_t
 {
 public:
-    canvas_impl_t(graphicsstate_t const& root_properties, std::string const& filename)
-        : eps::canvas_t(root_properties)
-        , m_ofs(filename, std::ofstream::out)
+    canvas_impl_t(std::string const& filename, canvas_mode_t mode)
+        : context_t()
+        , eps::canvas_t(m_root_properties)
+        , m_buffer(1 << 20)
+        , m_sink(m_ofs.rdbuf())
+        , m_peephole(m_sink)
+        , m_out(m_sink)
+        , m_optimize(false)
+        , m_mode(mode)
+        , m_area(null_bounding_box())
+        , m_viewport(null_bounding_box())
+        , m_has_viewport(false)
+        , m_closed(false)
     {
+        m_ofs.rdbuf()->pubsetbuf(m_buffer.data(), m_buffer.size());
+        m_ofs.open(filename, std::ofstream::out);
         if (!m_ofs.is_open())
         {
             THROW(std::runtime_error, "E0001", << "Cannot open'" << filename << "'");
         }
+        begin();
+    }
+    // The sink must outlive the canvas.
+    canvas_impl_t(std::streambuf& sink, canvas_mode_t mode)
+        : context_t()
+        , eps::canvas_t(m_root_properties)
+        , m_sink(&sink)
+        , m_peephole(m_sink)
+        , m_out(m_sink)
+        , m_optimize(false)
+        , m_mode(mode)
+        , m_area(null_bounding_box())
+        , m_viewport(null_bounding_box())
+        , m_has_viewport(false)
+        , m_closed(false)
+    {
+        begin();
+    }
+    void begin()
+    {
+        if (m_mode == canvas_mode_t::streaming)
+        {
+            m_out << "%!PS-Adobe-3.0\n" << "%%BoundingBox: (atend)" << std::endl;
+            m_out << "/Times-Roman 10 selectfont\n"; // select one font so that psfrag works
+        }
+    }
+    ~canvas_impl_t()
+    {
+        m_out.flush();
+        m_closing = true;
+    }
+    // In streaming mode a shape is drawn as soon as it is added and then
+    // released, so it must be complete when it is handed over.
+    void add(std::unique_ptr<shape_t>&& o) override
+    {
+        if (m_mode != canvas_mode_t::streaming)
+        {
+            group_t::add(std::move(o));
+            return;
+        }
+        if (m_closed)
+        {
+            THROW(std::logic_error, "E0002", << "Cannot add to a streaming canvas after draw()");
+        }
+        area_t shape_area = o->bounding_box(m_graphicsstate.epsilon());
+        if (m_has_viewport)
+        {
+            if (!intersects(painted_area(*o, m_graphicsstate.epsilon()), m_viewport))
+            {
+                return;
+            }
+            shape_area = intersection(shape_area, m_viewport);
+        }
+        min_bounding_box(m_area.m_min, shape_area.m_min);
+        max_bounding_box(m_area.m_max, shape_area.m_max);
+        draw_procedures();
+        // the shape clips to the viewport as it would in draw()
+        if (m_has_viewport)
+        {
+            m_out.pword(viewport_index) = &m_viewport;
+        }
+        o->draw(m_out, m_graphicsstate);
+        m_out.pword(viewport_index) = nullptr;
+        // the styles of the shape may go with it
+        o.reset();
+        m_graphicsstate.m_stroke_style = m_graphicsstate.m_fill_style = nullptr;
     }
     void draw() override
     {
-        eps::graphicsstate_t graphicsstate;
-        area_t area = bounding_box(graphicsstate.epsilon());
-        area.m_min.m_x = std::floor(area.m_min.m_x);
-        area.m_min.m_y = std::floor(area.m_min.m_y);
-        area.m_max.m_x = std::ceil(area.m_max.m_x);
-        area.m_max.m_y = std::ceil(area.m_max.m_y);
-        m_ofs << "%!PS-Adobe-3.0\n" << "%%BoundingBox: " << area << std::endl;
-        m_ofs << "/Times-Roman 10 selectfont\n"; // select one font so that psfrag works
-        for (eps::properties_override_t const& p : properties_mem_mgr)
+        merge_staged();
+        if (m_mode == canvas_mode_t::streaming)
         {
-            if (p.lineend(nullptr) && p.lineend(nullptr)->m_used)
+            if (!m_closed)
             {
-                p.lineend(nullptr)->m_used = false;
-                p.lineend(nullptr)->draw_procedure(m_ofs);
+                m_closed = true;
+                m_out << "%%Trailer\n" << "%%BoundingBox: " << integral_bounding_box(m_area) << "\n%%EOF" << std::endl;
             }
-            if (p.linebegin(nullptr) && p.linebegin(nullptr)->m_used)
+            return;
+        }
+        // every draw() writes a complete document, with the same names,
+        // and report() describes the last one
+        m_peephole.reset();
+        m_procedures.clear();
+        m_out.iword(instance_index) = 0;
+        for (int index : chunk_counters)
+        {
+            m_out.iword(index) = 0;
+        }
+        for (int index : cache_counters)
+        {
+            m_out.iword(index) = 0;
+        }
+        eps::graphicsstate_t graphicsstate;
+        area_t area = bounding_box(graphicsstate.epsilon());
+        if (m_has_viewport)
+        {
+            area = intersection(area, m_viewport);
+        }
+        m_out << "%!PS-Adobe-3.0\n" << "%%BoundingBox: " << integral_bounding_box(area) << std::endl;
+        m_out << "/Times-Roman 10 selectfont\n"; // select one font so that psfrag works
+        draw_encoding_procedures(m_out);
+        if (m_has_viewport)
+        {
+            draw_viewport();
+            m_out.pword(viewport_index) = &m_viewport;
+        }
+        draw_procedures();
+        group_t::draw(m_out, graphicsstate);
+        m_out.pword(viewport_index) = nullptr;
+        m_out.flush();
+    }
+    void setprecision(int decimals) override
+    {
+        set_precision(m_out, decimals);
+    }
+    // Route the output through the peephole optimizer. Switch it on before
+    // shapes are drawn, i.e. before draw() or, when streaming, before add().
+    void setoptimize(bool optimize) override
+    {
+        m_out.flush();
+        m_optimize = optimize;
+        m_out.rdbuf(m_optimize ? static_cast<std::streambuf*>(&m_peephole) : m_sink);
+    }
+    void setsimplify(bool simplify) override
+    {
+        set_simplify(m_out, simplify);
+    }
+    // Each shape keeps the bytes it wrote, and draw() copies them for the
+    // shapes that did not change since the previous draw(). Takes memory
+    // for the whole output; in streaming mode it does nothing.
+    void setcaching(bool caching) override
+    {
+        set_caching(m_out, caching);
+    }
+    // Segments are written relative to the current point where that is
+    // shorter. It takes effect only with a fixed precision, see
+    // setprecision(). When streaming, set it before add().
+    void setencoding(path_encoding_t encoding) override
+    {
+        set_encoding(m_out, encoding);
+        if (m_mode == canvas_mode_t::streaming)
+        {
+            draw_encoding_procedures(m_out);
+        }
+    }
+    // Shapes made by make() and the points and sections of all shapes that
+    // are created afterwards come from an arena, which is released as a
+    // whole with the canvas. Its paths are released with it, without
+    // running their destructors.
+    void setarena(bool arena) override
+    {
+        if (arena && !m_arena)
+        {
+            m_arena = std::make_unique<arena_t>();
+        }
+        m_resource = arena ? m_arena.get() : std::pmr::get_default_resource();
+    }
+    // Crops the canvas to the area. Shapes, or whole groups, outside of it
+    // are not drawn at all. When streaming, set it before add().
+    void setviewport(area_t const& area) override
+    {
+        m_viewport = area;
+        m_has_viewport = true;
+        if (m_mode == canvas_mode_t::streaming)
+        {
+            draw_viewport();
+        }
+    }
+    void draw_viewport()
+    {
+        new_path(m_out);
+        moveto(m_out, m_viewport.m_min);
+        lineto(m_out, point_t(m_viewport.m_max.m_x, m_viewport.m_min.m_y));
+        lineto(m_out, m_viewport.m_max);
+        lineto(m_out, point_t(m_viewport.m_min.m_x, m_viewport.m_max.m_y));
+        closepath(m_out);
+        clip(m_out);
+        new_path(m_out);
+    }
+    void report(std::ostream& stream) const override
+    {
+        if (m_optimize)
+        {
+            m_peephole.report(stream);
+        }
+        if (long simplified = const_cast<std::ostream&>(m_out).iword(simplified_index))
+        {
+            stream << "polyline simplification: " << simplified << " points removed\n";
+        }
+        if (long reordered = const_cast<std::ostream&>(m_out).iword(reordered_index))
+        {
+            stream << "draw reordering: " << reordered << " state changes removed\n";
+        }
+        if (long encoded = const_cast<std::ostream&>(m_out).iword(encoded_index))
+        {
+            stream << "relative encoding: " << encoded << " bytes removed\n";
+        }
+        long const hits = const_cast<std::ostream&>(m_out).iword(cache_hits_index);
+        if (long const lookups = hits + const_cast<std::ostream&>(m_out).iword(cache_misses_index))
+        {
+            stream << "emission cache: " << hits << " of " << lookups << " shapes reused (" << 100 * hits / lookups << "%), "
+                << const_cast<std::ostream&>(m_out).iword(cache_reused_index) << " bytes copied";
+            // shapes drawn in parallel or as instances are drawn past
+            // their cache, they count as drawn
+            if (long const bypassed = const_cast<std::ostream&>(m_out).iword(cache_bypassed_index))
             {
-                p.linebegin(nullptr)->m_used = false;
-                p.linebegin(nullptr)->draw_procedure(m_ofs);
+                stream << ", " << bypassed << " of them drawn in parallel or as instances";
             }
+            stream << '\n';
+        }
+    }
+    void draw_procedures()
+    {
+        m_properties.for_each([this](eps::properties_override_t const& p)
+        {
+            draw_procedure(p.lineend(nullptr));
+            draw_procedure(p.linebegin(nullptr));
+        });
+    }
+    void draw_procedure(lineending_t const* lineending)
+    {
+        if (lineending && m_procedures.insert(lineending).second)
+        {
+            lineending->draw_procedure(m_out);
         }
-        group_t::draw(m_ofs, graphicsstate);
     }
+    std::vector<char> m_buffer;
     std::ofstream m_ofs;
+    std::streambuf* m_sink;
+    peephole_t m_peephole;
+    std::ostream m_out;
+    bool m_optimize;
+    canvas_mode_t m_mode;
+    eps::graphicsstate_t m_graphicsstate; // streaming mode only
+    area_t m_area; // streaming mode only
+    area_t m_viewport;
+    bool m_has_viewport;
+    bool m_closed;
 };
 
-static graphicsstate_t const root_properties;
+std::unique_ptr<canvas_t> create_canvas(
+    std::string const& filename, canvas_mode_t mode)
+{
+    return std::make_unique<eps::canvas_impl_t>(filename, mode);
+}
 
 std::unique_ptr<canvas_t> create_canvas(
-    std::string const& filename)
+    std::streambuf& sink, canvas_mode_t mode)
+{
+    return std::make_unique<eps::canvas_impl_t>(sink, mode);
+}
+
+// A growable buffer; release() hands it out without a copy and starts a
+// new one.
+class memory_sink_impl_t
+    : public memory_sink_t
+{
+public:
+    explicit memory_sink_impl_t(size_t capacity)
+        : m_capacity(std::max<size_t>(capacity, 64))
+    {
+        reset();
+    }
+    std::string_view data() const override
+    {
+        return std::string_view(pbase(), pptr() - pbase());
+    }
+    std::string release() override
+    {
+        m_bytes.resize(pptr() - pbase());
+        std::string bytes = std::move(m_bytes);
+        reset();
+        return bytes;
+    }
+protected:
+    int_type overflow(int_type c) override
+    {
+        size_t const size = pptr() - pbase();
+        m_bytes.resize(m_bytes.size() * 2);
+        setp(&m_bytes[0], &m_bytes[0] + m_bytes.size());
+        advance(size);
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+private:
+    void reset()
+    {
+        m_bytes = std::string(m_capacity, '\0');
+        setp(&m_bytes[0], &m_bytes[0] + m_bytes.size());
+    }
+    // pbump only takes an int
+    void advance(size_t n)
+    {
+        for (; n > INT_MAX; n -= INT_MAX)
+        {
+            pbump(INT_MAX);
+        }
+        pbump(static_cast<int>(n));
+    }
+    size_t m_capacity;
+    std::string m_bytes;
+};
+
+std::unique_ptr<memory_sink_t> create_memory_sink(size_t capacity)
+{
+    return std::make_unique<memory_sink_impl_t>(capacity);
+}
+
+size_t const page_size = 4096;
+
+// Writes to a file descriptor through one buffer, aligned to and a
+// multiple of the page size so that it also suits files opened for direct
+// I/O. The descriptor is not closed.
+class fd_sink_t
+    : public std::streambuf
+{
+public:
+    fd_sink_t(int fd, size_t buffer_size)
+        : m_fd(fd)
+        , m_size((std::max(buffer_size, page_size) + page_size - 1) / page_size * page_size)
+        , m_buffer(static_cast<char*>(::operator new(m_size, std::align_val_t(page_size))))
+    {
+        setp(m_buffer.get(), m_buffer.get() + m_size);
+    }
+    ~fd_sink_t() override
+    {
+        write_buffer();
+    }
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (!write_buffer())
+        {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    int sync() override
+    {
+        return write_buffer() ? 0 : -1;
+    }
+private:
+    struct aligned_delete_t
+    {
+        void operator()(char* p) const
+        {
+            ::operator delete(p, std::align_val_t(page_size));
+        }
+    };
+    bool write_buffer()
+    {
+        char const* p = pbase();
+        char const* const end = pptr();
+        while (p != end)
+        {
+#ifdef _WIN32
+            int const written = _write(m_fd, p, static_cast<unsigned int>(std::min<size_t>(end - p, INT_MAX)));
+#else
+            ssize_t const written = ::write(m_fd, p, end - p);
+#endif
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            // a write that makes no progress would be retried forever
+            if (written <= 0)
+            {
+                // keep what was not written, a later sync() tries again
+                std::memmove(m_buffer.get(), p, end - p);
+                setp(m_buffer.get(), m_buffer.get() + m_size);
+                pbump(static_cast<int>(end - p));
+                return false;
+            }
+            p += written;
+        }
+        setp(m_buffer.get(), m_buffer.get() + m_size);
+        return true;
+    }
+    int m_fd;
+    size_t m_size;
+    std::unique_ptr<char, aligned_delete_t> m_buffer;
+};
+
+std::unique_ptr<std::streambuf> create_fd_sink(int fd, size_t buffer_size)
+{
+    return std::make_unique<fd_sink_t>(fd, buffer_size);
+}
+
+// Double buffered: while a thread writes the full buffer to the target,
+// formatting goes on in the other one. sync() waits until everything is
+// written and then syncs the target.
+class async_sink_t
+    : public std::streambuf
+{
+public:
+    async_sink_t(std::streambuf& target, size_t buffer_size)
+        : m_target(target)
+        , m_front(std::max<size_t>(buffer_size, 64))
+        , m_back(m_front.size())
+        , m_pending(0)
+        , m_done(false)
+        , m_failed(false)
+    {
+        setp(m_front.data(), m_front.data() + m_front.size());
+        m_thread = std::thread([this]() { run(); });
+    }
+    ~async_sink_t() override
+    {
+        hand_off();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done = true;
+        }
+        m_changed.notify_all();
+        m_thread.join();
+        m_target.pubsync();
+    }
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (!hand_off())
+        {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    int sync() override
+    {
+        if (!hand_off())
+        {
+            return -1;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return !m_pending; });
+        return m_failed || m_target.pubsync() != 0 ? -1 : 0;
+    }
+private:
+    // Passes the front buffer on, once the thread is done with the back one.
+    bool hand_off()
+    {
+        size_t const n = pptr() - pbase();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return !m_pending; });
+        if (n)
+        {
+            m_front.swap(m_back);
+            m_pending = n;
+            m_changed.notify_all();
+            setp(m_front.data(), m_front.data() + m_front.size());
+        }
+        return !m_failed;
+    }
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_changed.wait(lock, [this]() { return m_pending || m_done; });
+            if (!m_pending)
+            {
+                return;
+            }
+            size_t const n = m_pending;
+            lock.unlock();
+            bool const written = m_target.sputn(m_back.data(), static_cast<std::streamsize>(n)) == static_cast<std::streamsize>(n);
+            lock.lock();
+            m_failed = m_failed || !written;
+            m_pending = 0;
+            m_changed.notify_all();
+        }
+    }
+    std::streambuf& m_target;
+    std::vector<char> m_front;
+    std::vector<char> m_back;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    size_t m_pending; // bytes of m_back to write
+    bool m_done;
+    bool m_failed;
+    std::thread m_thread;
+};
+
+std::unique_ptr<std::streambuf> create_async_sink(std::streambuf& target, size_t buffer_size)
 {
-    return std::make_unique<eps::canvas_impl_t>(root_properties, filename);
+    return std::make_unique<async_sink_t>(target, buffer_size);
 }
 
 EPS_API void handle_exception()
@@ -0,0 +1,494 @@
+// Public interface of the eps library: geometry, properties, shapes, groups
+// and canvases, and the sinks a canvas writes to. eps_basic_shapes.h adds the
+// concrete shapes.
+#pragma once
+#include <string_view>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <memory_resource>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#if !defined(EPS_API)
+#if defined(_WIN32) && defined(EPS_EXPORTS)
+#define EPS_API __declspec(dllexport)
+#else
+#define EPS_API
+#endif
+#endif
+#define THROW(TYPE, CODE, MSG) { std::stringstream ss_; ss_ << CODE << ": " MSG; throw TYPE(ss_.str()); }
+
+namespace eps
+{
+double const pi = 3.14159265358979323846;
+inline float to_deg(float r) { return static_cast<float>(r * 180 / pi); }
+template<typename T> T clip(T v, T lo, T hi) { return std::min(std::max(v, lo), hi); }
+inline float bezier(float a, float ai, float bi, float b, float t)
+{ float s = 1 - t; return s*s*s*a + 3*s*s*t*ai + 3*s*t*t*bi + t*t*t*b; }
+// Solves a t^2 + b t + c = 0; n is the number of roots put in t1 and t2.
+inline void abc_formula(float a, float b, float c, float epsilon, int& n, float& t1, float& t2)
+{
+    if (std::fabs(a) <= epsilon)
+    {
+        if (std::fabs(b) <= epsilon)
+        {
+            n = 0;
+            return;
+        }
+        n = 1;
+        t1 = t2 = -c / b;
+        return;
+    }
+    float const d = b * b - 4 * a * c;
+    if (d < 0)
+    {
+        n = 0;
+        return;
+    }
+    n = 2;
+    t1 = (-b + std::sqrt(d)) / (2 * a);
+    t2 = (-b - std::sqrt(d)) / (2 * a);
+}
+// Whether angle lies on the arc from aa to ab, counter clockwise when positive.
+inline bool in_arc(float angle, float aa, float ab, bool positive)
+{
+    auto normalize = [](float x)
+    {
+        x = std::fmod(x, static_cast<float>(2 * pi));
+        return x < 0 ? x + static_cast<float>(2 * pi) : x;
+    };
+    return normalize(positive ? angle - aa : aa - angle) <= normalize(positive ? ab - aa : aa - ab);
+}
+
+struct transformation_t;
+struct vect_t
+{
+    vect_t() : m_x(0), m_y(0) {}
+    vect_t(float x, float y) : m_x(x), m_y(y) {}
+    vect_t& operator*=(float f) { m_x *= f; m_y *= f; return *this; }
+    vect_t& operator*=(transformation_t const& t);
+    float m_x, m_y;
+};
+struct point_t
+{
+    point_t() : m_x(0), m_y(0) {}
+    point_t(float x, float y) : m_x(x), m_y(y) {}
+    point_t& operator*=(transformation_t const& t);
+    point_t& operator+=(vect_t v) { m_x += v.m_x; m_y += v.m_y; return *this; }
+    float m_x, m_y;
+};
+inline vect_t operator-(point_t a, point_t b) { return vect_t(a.m_x - b.m_x, a.m_y - b.m_y); }
+inline point_t operator+(point_t a, vect_t b) { return point_t(a.m_x + b.m_x, a.m_y + b.m_y); }
+inline point_t operator-(point_t a, vect_t b) { return point_t(a.m_x - b.m_x, a.m_y - b.m_y); }
+inline bool operator==(point_t a, point_t b) { return a.m_x == b.m_x && a.m_y == b.m_y; }
+inline bool operator!=(point_t a, point_t b) { return !(a == b); }
+inline float abs(vect_t v) { return std::sqrt(v.m_x*v.m_x + v.m_y*v.m_y); }
+inline float abs(point_t v) { return std::sqrt(v.m_x*v.m_x + v.m_y*v.m_y); }
+using std::abs;
+struct area_t
+{
+    area_t() {}
+    area_t(point_t mn, point_t mx) : m_min(mn), m_max(mx) {}
+    point_t m_min, m_max;
+};
+struct rotation_t { vect_t m_x{1,0}, m_y{0,1}; };
+struct transformation_t
+{
+    rotation_t m_r;
+    point_t m_t;
+};
+inline point_t& point_t::operator*=(transformation_t const& t)
+{
+    float const x = t.m_r.m_x.m_x * m_x + t.m_r.m_y.m_x * m_y + t.m_t.m_x;
+    float const y = t.m_r.m_x.m_y * m_x + t.m_r.m_y.m_y * m_y + t.m_t.m_y;
+    m_x = x;
+    m_y = y;
+    return *this;
+}
+inline vect_t& vect_t::operator*=(transformation_t const& t)
+{
+    float const x = t.m_r.m_x.m_x * m_x + t.m_r.m_y.m_x * m_y;
+    float const y = t.m_r.m_x.m_y * m_x + t.m_r.m_y.m_y * m_y;
+    m_x = x;
+    m_y = y;
+    return *this;
+}
+// The inverse of t.
+inline transformation_t operator~(transformation_t const& t)
+{
+    float const det = t.m_r.m_x.m_x * t.m_r.m_y.m_y - t.m_r.m_x.m_y * t.m_r.m_y.m_x;
+    transformation_t r;
+    r.m_r.m_x = vect_t(t.m_r.m_y.m_y / det, -t.m_r.m_x.m_y / det);
+    r.m_r.m_y = vect_t(-t.m_r.m_y.m_x / det, t.m_r.m_x.m_x / det);
+    vect_t v(-t.m_t.m_x, -t.m_t.m_y);
+    v *= r;
+    r.m_t = point_t(v.m_x, v.m_y);
+    return r;
+}
+// a after b.
+inline transformation_t operator*(transformation_t const& a, transformation_t const& b)
+{
+    transformation_t r;
+    r.m_r.m_x = b.m_r.m_x;
+    r.m_r.m_x *= a;
+    r.m_r.m_y = b.m_r.m_y;
+    r.m_r.m_y *= a;
+    r.m_t = b.m_t;
+    r.m_t *= a;
+    return r;
+}
+inline void min_bounding_box(point_t& m, point_t p) { m.m_x = std::min(m.m_x, p.m_x); m.m_y = std::min(m.m_y, p.m_y); }
+inline void max_bounding_box(point_t& m, point_t p) { m.m_x = std::max(m.m_x, p.m_x); m.m_y = std::max(m.m_y, p.m_y); }
+
+std::ostream& operator<<(std::ostream& o, vect_t v);
+std::ostream& operator<<(std::ostream& o, point_t v);
+std::ostream& operator<<(std::ostream& o, area_t a);
+std::ostream& operator<<(std::ostream& o, rotation_t r);
+std::ostream& operator<<(std::ostream& o, transformation_t t);
+
+enum class cap_t { butt, round, square };
+enum class join_t { miter, round, bevel };
+enum class text_ref_t { bl, bc, br, cl, cc, cr, tl, tc, tr, Bl, Bc, Br, number_of_text_refs };
+
+struct lineending_t
+{
+    virtual ~lineending_t() {}
+    virtual void draw_procedure(std::ostream&) const = 0;
+    virtual void draw(std::ostream&, point_t, float, float, float, float, float) const = 0;
+    bool m_used = false;
+};
+struct linestyle_t
+{
+    virtual ~linestyle_t() {}
+    virtual void draw(std::ostream&) const = 0;
+};
+lineending_t* lineending_none();
+linestyle_t* linestyle_none();
+
+class context_t;
+struct resolved_style_t;
+class iproperties_t
+{
+public:
+    virtual ~iproperties_t() {}
+    virtual context_t* context() const;
+    virtual resolved_style_t const* resolved_style() const;
+    virtual float linewidth() const = 0;
+    virtual float linercolor() const = 0;
+    virtual float linegcolor() const = 0;
+    virtual float linebcolor() const = 0;
+    virtual float fillrcolor() const = 0;
+    virtual float fillgcolor() const = 0;
+    virtual float fillbcolor() const = 0;
+    virtual cap_t linecap() const = 0;
+    virtual join_t linejoin() const = 0;
+    virtual float miterlimit() const = 0;
+    virtual float epsilon() const = 0;
+    virtual lineending_t* lineend() const = 0;
+    virtual lineending_t* linebegin() const = 0;
+    virtual linestyle_t* linestyle() const = 0;
+};
+
+class properties_override_t
+{
+public:
+#define P(TYPE, NAME) \
+    TYPE NAME(TYPE parent) const { return m_has_##NAME ? m_##NAME : parent; } \
+    void set##NAME(TYPE v) { m_has_##NAME = true; m_##NAME = v; } \
+    bool m_has_##NAME = false; TYPE m_##NAME{};
+    P(float, linewidth) P(float, linercolor) P(float, linegcolor) P(float, linebcolor)
+    P(float, fillrcolor) P(float, fillgcolor) P(float, fillbcolor)
+    P(cap_t, linecap) P(join_t, linejoin) P(float, miterlimit) P(float, epsilon)
+    P(lineending_t*, lineend) P(lineending_t*, linebegin) P(linestyle_t*, linestyle)
+#undef P
+    void setlinergbcolor(float r, float g, float b) { setlinercolor(r); setlinegcolor(g); setlinebcolor(b); }
+    void setfillrgbcolor(float r, float g, float b) { setfillrcolor(r); setfillgcolor(g); setfillbcolor(b); }
+    bool operator<(properties_override_t const& other) const
+    {
+#define P(NAME) \
+        if (m_has_##NAME != other.m_has_##NAME) return m_has_##NAME < other.m_has_##NAME; \
+        if (m_has_##NAME && m_##NAME != other.m_##NAME) return std::less<decltype(m_##NAME)>()(m_##NAME, other.m_##NAME);
+        P(linewidth) P(linercolor) P(linegcolor) P(linebcolor) P(fillrcolor) P(fillgcolor) P(fillbcolor)
+        P(linecap) P(linejoin) P(miterlimit) P(epsilon) P(lineend) P(linebegin) P(linestyle)
+#undef P
+        return false;
+    }
+    bool operator==(properties_override_t const& other) const
+    {
+        return !(*this < other) && !(other < *this);
+    }
+    mutable int m_ref_count = 0;
+};
+
+class graphicsstate_t
+    : public iproperties_t
+{
+public:
+#define P(TYPE, NAME, INIT) \
+    TYPE NAME() const override { return m_##NAME; } \
+    void set##NAME(TYPE v) { m_##NAME = v; m_stroke_style = m_fill_style = nullptr; } \
+    TYPE m_##NAME = INIT;
+    P(float, linewidth, 1) P(float, linercolor, 0) P(float, linegcolor, 0) P(float, linebcolor, 0)
+    P(float, fillrcolor, 0) P(float, fillgcolor, 0) P(float, fillbcolor, 0)
+    P(cap_t, linecap, cap_t::butt) P(join_t, linejoin, join_t::miter) P(float, miterlimit, 10) P(float, epsilon, 0.001f)
+    P(lineending_t*, lineend, lineending_none()) P(lineending_t*, linebegin, lineending_none()) P(linestyle_t*, linestyle, linestyle_none())
+#undef P
+    void setlinergbcolor(float r, float g, float b) { m_linercolor = r; m_linegcolor = g; m_linebcolor = b; m_stroke_style = m_fill_style = nullptr; }
+    void setfillrgbcolor(float r, float g, float b) { m_fillrcolor = r; m_fillgcolor = g; m_fillbcolor = b; m_stroke_style = m_fill_style = nullptr; }
+    resolved_style_t const* m_stroke_style = nullptr;
+    resolved_style_t const* m_fill_style = nullptr;
+};
+
+float get_epsilon(graphicsstate_t& graphicsstate);
+float stroke_margin(iproperties_t const& properties);
+void new_path(std::ostream& stream);
+void closepath(std::ostream& stream);
+void setstrokestate(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties);
+void setfillstate(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties);
+void stroke(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties);
+void fill(std::ostream& stream, graphicsstate_t& graphicsstate, iproperties_t const& properties, bool and_stroke);
+void gsave(std::ostream& stream);
+void grestore(std::ostream& stream);
+void initgraphics(std::ostream& stream, graphicsstate_t& graphicsstate);
+void moveto(std::ostream& stream, point_t p);
+void rmoveto(std::ostream& stream, vect_t v);
+void lineto(std::ostream& stream, point_t p);
+void lineto(std::ostream& stream, point_t current, point_t p);
+void rlineto(std::ostream& stream, vect_t v);
+void set_simplify(std::ostream& stream, bool simplify);
+enum class path_encoding_t { absolute, relative, relative_aliases };
+void set_encoding(std::ostream& stream, path_encoding_t encoding);
+void set_caching(std::ostream& stream, bool caching);
+void draw_encoding_procedures(std::ostream& stream);
+void polyline(std::ostream& stream, point_t const* points, size_t n, point_t origin, float epsilon, bool simplify);
+void curveto(std::ostream& stream, point_t tangent1, point_t tangent2, point_t end);
+void curveto(std::ostream& stream, point_t current, point_t tangent1, point_t tangent2, point_t end);
+void rcurveto(std::ostream& stream, vect_t tangent1, vect_t tangent2, vect_t end);
+void arc(std::ostream& stream, point_t center, float radius, float begin_angle, float end_angle);
+void arcn(std::ostream& stream, point_t center, float radius, float begin_angle, float end_angle);
+void arct(std::ostream& stream, point_t tangent, point_t end, float radius);
+void show(std::ostream& stream, std::string const& text);
+void showlatex(std::ostream& stream, std::string const& text, text_ref_t text_ref, float scale, float rotate);
+void clip(std::ostream& stream);
+void pushmatrix(std::ostream& stream);
+void concatmatrix(std::ostream& stream, transformation_t const& transformation);
+void popmatrix(std::ostream& stream);
+void scale(std::ostream& stream, float x, float y);
+void rotate(std::ostream& stream, float angle);
+void concat(std::ostream& stream, transformation_t t);
+void begin_procedure(std::ostream& stream, std::string const& name, std::vector<char const*> l);
+void end_procedure(std::ostream& stream);
+void call_procedure(std::ostream& stream, std::string const& name);
+void draw_ellipse(std::ostream& stream, point_t a, point_t c, vect_t rx, vect_t ry, float epsilon);
+void draw_arc(std::ostream& stream, point_t a, point_t c, vect_t rx, vect_t ry, point_t b, float epsilon);
+void set_precision(std::ostream& stream, int decimals);
+void write_number(std::ostream& stream, float v);
+std::string unique_name(std::ostream& stream, char const* prefix);
+area_t const* viewport(std::ostream& stream);
+area_t null_bounding_box();
+area_t bezier_bounding_box(point_t a, point_t ai, point_t bi, point_t b, float epsilon);
+area_t ellipse_bounding_box(point_t a, point_t c, vect_t rx, vect_t ry, float epsilon);
+area_t arc_bounding_box(point_t a, point_t c, vect_t rx, vect_t ry, point_t b, float epsilon);
+std::string single_line_it(std::string const& in);
+std::string single_line_listing(std::string const& in, char delim_char);
+std::string multi_line_listing(float width, std::string const& in, char delim_char);
+
+class style_t
+{
+public:
+    style_t& setlinewidth(float);
+    style_t& setlinegray(float);
+    style_t& setlinergbcolor(float, float, float);
+    style_t& setfillgray(float);
+    style_t& setfillrgbcolor(float, float, float);
+    style_t& setlinecap(cap_t);
+    style_t& setlinejoin(join_t);
+    style_t& setmiterlimit(float);
+    style_t& setepsilon(float);
+    style_t& setlineend(lineending_t*);
+    style_t& setlinebegin(lineending_t*);
+    style_t& setlinestyle(linestyle_t*);
+private:
+    enum : uint32_t
+    {
+        linewidth_bit = 1 << 0, linecolor_bit = 1 << 1, fillcolor_bit = 1 << 2,
+        linecap_bit = 1 << 3, linejoin_bit = 1 << 4, miterlimit_bit = 1 << 5,
+        epsilon_bit = 1 << 6, lineend_bit = 1 << 7, linebegin_bit = 1 << 8, linestyle_bit = 1 << 9
+    };
+    void apply(properties_override_t& properties_override) const;
+    properties_override_t m_properties;
+    uint32_t m_set = 0;
+    friend class shape_t;
+};
+
+struct emission_t;
+class shape_t
+    : public iproperties_t
+{
+public:
+    shape_t(iproperties_t const& parent_properties);
+    shape_t(shape_t const& other);
+    virtual ~shape_t();
+    static void* operator new(size_t size);
+    static void* operator new(size_t size, std::pmr::memory_resource* resource);
+    static void operator delete(void* p);
+    static void operator delete(void* p, std::pmr::memory_resource* resource);
+    std::pmr::memory_resource* resource() const;
+    context_t* context() const override;
+    resolved_style_t const* resolved_style() const override;
+    virtual void draw(std::ostream& stream, graphicsstate_t& graphicsstate) const = 0;
+    virtual area_t bounding_box(float epsilon) = 0;
+    virtual void apply(transformation_t const& t, bool excluding_text) = 0;
+    virtual bool releasable(std::pmr::memory_resource const* resource) const;
+    virtual bool draw_geometry(std::ostream& stream, point_t& origin, float epsilon) const;
+    virtual void paint(std::ostream& stream, graphicsstate_t& graphicsstate) const;
+    virtual float painted_margin() const;
+    void draw_cached(std::ostream& stream, graphicsstate_t& graphicsstate) const;
+    void setlinewidth(float);
+    void setlinegray(float);
+    void setlinergbcolor(float, float, float);
+    void setfillgray(float);
+    void setfillrgbcolor(float, float, float);
+    void setlinecap(cap_t);
+    void setlinejoin(join_t);
+    void setmiterlimit(float);
+    void setepsilon(float);
+    void setlineend(lineending_t*);
+    void setlinebegin(lineending_t*);
+    void setlinestyle(linestyle_t*);
+    void setstyle(style_t const& style);
+    float linewidth() const override;
+    float linercolor() const override;
+    float linegcolor() const override;
+    float linebcolor() const override;
+    float fillrcolor() const override;
+    float fillgcolor() const override;
+    float fillbcolor() const override;
+    cap_t linecap() const override;
+    join_t linejoin() const override;
+    float miterlimit() const override;
+    float epsilon() const override;
+    lineending_t* lineend() const override;
+    lineending_t* linebegin() const override;
+    linestyle_t* linestyle() const override;
+private:
+    void inc_ref();
+    void dec_ref();
+    void get(properties_override_t& properties_override) const;
+    void add(properties_override_t const& properties_override);
+protected:
+    bool is_bounding_box_cached() const;
+    bool is_bounding_box_valid(float epsilon) const;
+    void cache_bounding_box(area_t const& area, float epsilon);
+    void invalidate_bounding_box();
+    void extend_bounding_box(area_t const& area);
+    void apply_bounding_box(transformation_t const& t);
+    void shape_changed();
+    virtual void owned_shape_changed();
+    void invalidate_emission();
+    virtual area_t owner_area(area_t const& area) const;
+    iproperties_t const& m_parent_properties;
+    context_t* m_context;
+    properties_override_t const* m_pproperties_override;
+    area_t m_bounding_box;
+    float m_bounding_box_epsilon;
+    shape_t* m_owner;
+    mutable resolved_style_t const* m_resolved_style;
+    mutable resolved_style_t const* m_resolved_parent;
+    mutable std::unique_ptr<emission_t> m_emission;
+    friend class group_t;
+};
+
+class spatial_index_t;
+class staging_t;
+class group_t
+    : public shape_t
+{
+public:
+    class producer_t
+    {
+    public:
+        void add(std::unique_ptr<shape_t>&& o);
+    private:
+        friend class group_t;
+        std::vector<std::unique_ptr<shape_t>> m_shapes;
+    };
+    producer_t& producer(unsigned id);
+    void merge();
+    group_t(iproperties_t const& parent_properties);
+    ~group_t() override;
+    virtual void add(std::unique_ptr<shape_t>&& o);
+    area_t bounding_box(float epsilon) override;
+    void draw(std::ostream& stream, graphicsstate_t& graphicsstate) const override;
+    void apply(transformation_t const& t, bool excluding_text) override;
+    float painted_margin() const override;
+    void setinstancing(bool instancing);
+    void setreorder(bool reorder);
+    void setindexing(bool indexing);
+    std::vector<shape_t*> intersecting(area_t const& area, float epsilon) const;
+    void setlazytransform(bool lazy);
+    void setparallel(unsigned threads);
+protected:
+    void find(area_t const& area, float epsilon, std::vector<size_t>& indices) const;
+    void draw_shapes(std::ostream& stream, graphicsstate_t& graphicsstate) const;
+    void draw_parallel(std::ostream& stream, graphicsstate_t& graphicsstate, std::vector<size_t> const& order) const;
+    area_t owner_area(area_t const& area) const override;
+    void owned_shape_changed() override;
+    void flatten();
+    std::vector<std::unique_ptr<shape_t>> m_shapes;
+    bool m_instancing = false;
+    bool m_reorder = false;
+    bool m_indexing = false;
+    mutable std::unique_ptr<spatial_index_t> m_index;
+    transformation_t m_transformation;
+    bool m_lazy = false;
+    bool m_transformed = false;
+    unsigned m_threads = 1;
+    std::unique_ptr<staging_t> m_staging;
+};
+
+class canvas_t
+    : public group_t
+{
+public:
+    using group_t::group_t;
+    virtual void draw() = 0;
+    virtual void setprecision(int decimals) = 0;
+    virtual void setoptimize(bool optimize) = 0;
+    virtual void setsimplify(bool simplify) = 0;
+    virtual void setcaching(bool caching) = 0;
+    virtual void setencoding(path_encoding_t encoding) = 0;
+    virtual void setviewport(area_t const& area) = 0;
+    virtual void setarena(bool arena) = 0;
+    template<typename T, typename... Args>
+    std::unique_ptr<T> make(Args&&... args)
+    {
+        return std::unique_ptr<T>(new (resource()) T(std::forward<Args>(args)...));
+    }
+    virtual void report(std::ostream& stream) const = 0;
+    using group_t::draw;
+};
+
+enum class canvas_mode_t { buffered, streaming };
+std::unique_ptr<canvas_t> create_canvas(std::string const& filename, canvas_mode_t mode = canvas_mode_t::buffered);
+std::unique_ptr<canvas_t> create_canvas(std::streambuf& sink, canvas_mode_t mode = canvas_mode_t::buffered);
+class memory_sink_t
+    : public std::streambuf
+{
+public:
+    virtual std::string_view data() const = 0;
+    virtual std::string release() = 0;
+};
+std::unique_ptr<memory_sink_t> create_memory_sink(size_t capacity = 1 << 16);
+std::unique_ptr<std::streambuf> create_fd_sink(int fd, size_t buffer_size = 1 << 20);
+std::unique_ptr<std::streambuf> create_async_sink(std::streambuf& target, size_t buffer_size = 1 << 20);
+EPS_API void handle_exception();
+
+}; // namespace eps
@@ -0,0 +1,117 @@
+// The basic shapes of the eps library: paths, markers, images and meshes.
+#pragma once
+#include "eps/eps.h"
+
+namespace eps
+{
+
+class dynamic_shape_t
+    : public shape_t
+{
+public:
+    dynamic_shape_t(iproperties_t const& parent_properties) : shape_t(parent_properties), m_(resource()) {}
+    dynamic_shape_t(dynamic_shape_t const& other) : shape_t(other), m_(other.m_, resource()) {}
+    void apply(transformation_t const& t, bool) override
+    {
+        for (point_t& p : m_) p *= t;
+    }
+protected:
+    std::pmr::vector<point_t> m_;
+};
+
+class path_t
+    : public dynamic_shape_t
+{
+public:
+    path_t(iproperties_t const& parent_properties);
+    path_t(path_t const& rhs);
+    void draw(std::ostream& stream, graphicsstate_t& graphicsstate) const override;
+    area_t bounding_box(float epsilon) override;
+    void apply(transformation_t const& t, bool excluding_text) override;
+    bool releasable(std::pmr::memory_resource const* resource) const override;
+    bool draw_geometry(std::ostream& stream, point_t& origin, float epsilon) const override;
+    void paint(std::ostream& stream, graphicsstate_t& graphicsstate) const override;
+    void moveto(point_t p);
+    void lineto(point_t p);
+    void curveto(point_t tangent1, point_t tangent2, point_t end);
+    void arcto(point_t center, point_t x_ax, point_t y_ax, point_t end);
+    void closepath();
+    void polyline(point_t const* points, size_t n);
+    void polyline(std::pmr::vector<point_t>&& points);
+    void polygon(point_t const* points, size_t n);
+    void polygon(std::pmr::vector<point_t>&& points);
+    void bezier_chain(point_t const* points, size_t n);
+    void setfill(bool fill) { m_fill = fill; }
+    void draw_sections(std::ostream& stream, point_t origin, float epsilon) const;
+    void setsimplify(bool simplify);
+protected:
+    void add_lines(size_t n);
+    void draw_clipped_sections(std::ostream& stream, area_t const& area, float epsilon) const;
+    std::pmr::vector<uint8_t> m_ops;
+    bool m_fill;
+    bool m_simplify;
+};
+
+class markers_t
+    : public shape_t
+{
+public:
+    markers_t(iproperties_t const& parent_properties);
+    void draw(std::ostream& stream, graphicsstate_t& graphicsstate) const override;
+    area_t bounding_box(float epsilon) override;
+    void apply(transformation_t const& t, bool excluding_text) override;
+    path_t& marker();
+    void setpoints(std::vector<point_t> points);
+    void setsizes(std::vector<float> sizes);
+    void setcolors(std::vector<uint8_t> color_indices, std::vector<float> palette);
+    void setfill(bool fill);
+protected:
+    std::unique_ptr<path_t> m_marker;
+    std::vector<point_t> m_points;
+    std::vector<float> m_sizes;
+    std::vector<uint8_t> m_color_indices;
+    std::vector<float> m_palette;
+    bool m_fill;
+};
+
+class image_t
+    : public shape_t
+{
+public:
+    image_t(iproperties_t const& parent_properties);
+    void draw(std::ostream& stream, graphicsstate_t& graphicsstate) const override;
+    area_t bounding_box(float epsilon) override;
+    void apply(transformation_t const& t, bool excluding_text) override;
+    void setpixels(uint8_t const* pixels, int width, int height, int components);
+    void setarea(area_t area);
+    void setrunlength(bool runlength);
+protected:
+    uint8_t const* m_pixels;
+    int m_width;
+    int m_height;
+    int m_components;
+    bool m_runlength;
+    point_t m_origin;
+    point_t m_x_corner;
+    point_t m_y_corner;
+};
+
+class mesh_t
+    : public shape_t
+{
+public:
+    mesh_t(iproperties_t const& parent_properties);
+    void draw(std::ostream& stream, graphicsstate_t& graphicsstate) const override;
+    area_t bounding_box(float epsilon) override;
+    void apply(transformation_t const& t, bool excluding_text) override;
+    void setvertices(std::vector<point_t> vertices, std::vector<float> colors);
+    void settriangles(std::vector<uint32_t> triangles);
+    void setlattice(int vertices_per_row);
+protected:
+    std::vector<point_t> m_vertices;
+    std::vector<float> m_colors;
+    std::vector<uint32_t> m_triangles;
+    int m_vertices_per_row;
+};
+
+}; // namespace eps
@@ -0,0 +1,377 @@
+// Benchmarks of the eps library. eps_bench.vcxproj builds this file together
+// with the library; run its release build, it prints the best of a few runs
+// of each case.
+#include "eps/eps_basic_shapes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace // anonymous
+{
+
+using steady_clock = std::chrono::steady_clock;
+
+size_t const runs = 3;
+
+double seconds(steady_clock::time_point begin, steady_clock::time_point end)
+{
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+// Builds a canvas of small paths in a few line widths and tears it down
+// again, the shapes taken from the heap or from the canvas arena.
+void bench_arena()
+{
+    size_t const n = 1000000;
+    for (bool arena : { false, true })
+    {
+        double construct = 1e9;
+        double teardown = 1e9;
+        for (size_t run = 0; run < runs; ++run)
+        {
+            auto sink = eps::create_memory_sink();
+            steady_clock::time_point const t0 = steady_clock::now();
+            auto canvas = eps::create_canvas(*sink);
+            canvas->setarena(arena);
+            for (size_t i = 0; i < n; ++i)
+            {
+                float const x = static_cast<float>(i % 1000);
+                float const y = static_cast<float>(i / 1000);
+                auto path = arena ? canvas->make<eps::path_t>(*canvas) : std::make_unique<eps::path_t>(*canvas);
+                path->moveto(eps::point_t(x, y));
+                path->lineto(eps::point_t(x + 1.f, y));
+                path->lineto(eps::point_t(x + 1.f, y + 1.f));
+                path->setlinewidth(static_cast<float>(i % 4) + 1.f);
+                canvas->add(std::move(path));
+            }
+            steady_clock::time_point const t1 = steady_clock::now();
+            canvas.reset();
+            steady_clock::time_point const t2 = steady_clock::now();
+            construct = std::min(construct, seconds(t0, t1));
+            teardown = std::min(teardown, seconds(t1, t2));
+        }
+        std::cout << (arena ? "arena" : "heap ") << ": " << n << " styled paths, construct " << construct << " s, teardown " << teardown << " s\n";
+    }
+}
+
+// The section layout path_t had before its opcode array, kept as the
+// reference bench_paths measures against: one heap section per segment,
+// told apart with dynamic_cast.
+namespace legacy
+{
+
+class section_t
+{
+public:
+    virtual ~section_t() = default;
+};
+
+class beginpoint_t
+    : public section_t
+{
+public:
+    beginpoint_t(int a) : m_a(a) {}
+    int m_a;
+};
+
+class linesection_t
+    : public section_t
+{
+public:
+    linesection_t(int b) : m_b(b) {}
+    int m_b;
+};
+
+class beziersection_t
+    : public section_t
+{
+public:
+    beziersection_t(int a, int ai, int bi, int b) : m_a(a), m_ai(ai), m_bi(bi), m_b(b) {}
+    int m_a;
+    int m_ai;
+    int m_bi;
+    int m_b;
+};
+
+class arcsection_t
+    : public section_t
+{
+public:
+    arcsection_t(int a, int c, int ax, int ay, int b) : m_a(a), m_c(c), m_ax(ax), m_ay(ay), m_b(b) {}
+    int m_a;
+    int m_c;
+    int m_ax;
+    int m_ay;
+    int m_b;
+};
+
+class closepath_t
+    : public section_t
+{};
+
+class path_t
+{
+public:
+    path_t() = default;
+
+    path_t(path_t const& rhs)
+        : m_(rhs.m_)
+    {
+        m_sections.reserve(rhs.m_sections.size());
+        for (std::unique_ptr<section_t> const& section : rhs.m_sections)
+        {
+            if (beginpoint_t const* s = dynamic_cast<beginpoint_t const*>(section.get()))
+            {
+                m_sections.push_back(std::make_unique<beginpoint_t>(*s));
+            }
+            else if (linesection_t const* s = dynamic_cast<linesection_t const*>(section.get()))
+            {
+                m_sections.push_back(std::make_unique<linesection_t>(*s));
+            }
+            else if (beziersection_t const* s = dynamic_cast<beziersection_t const*>(section.get()))
+            {
+                m_sections.push_back(std::make_unique<beziersection_t>(*s));
+            }
+            else if (arcsection_t const* s = dynamic_cast<arcsection_t const*>(section.get()))
+            {
+                m_sections.push_back(std::make_unique<arcsection_t>(*s));
+            }
+            else if (closepath_t const* s = dynamic_cast<closepath_t const*>(section.get()))
+            {
+                m_sections.push_back(std::make_unique<closepath_t>(*s));
+            }
+        }
+    }
+
+    eps::area_t bounding_box(float epsilon) const
+    {
+        eps::area_t area = eps::null_bounding_box();
+        for (std::unique_ptr<section_t> const& s : m_sections)
+        {
+            if (beginpoint_t const* p = dynamic_cast<beginpoint_t const*>(s.get()))
+            {
+                eps::min_bounding_box(area.m_min, m_[p->m_a]);
+                eps::max_bounding_box(area.m_max, m_[p->m_a]);
+            }
+            else if (linesection_t const* p = dynamic_cast<linesection_t const*>(s.get()))
+            {
+                eps::min_bounding_box(area.m_min, m_[p->m_b]);
+                eps::max_bounding_box(area.m_max, m_[p->m_b]);
+            }
+            else if (beziersection_t const* p = dynamic_cast<beziersection_t const*>(s.get()))
+            {
+                eps::area_t bb = eps::bezier_bounding_box(m_[p->m_a], m_[p->m_ai], m_[p->m_bi], m_[p->m_b], epsilon);
+                eps::min_bounding_box(area.m_min, bb.m_min);
+                eps::max_bounding_box(area.m_max, bb.m_max);
+            }
+            else if (arcsection_t const* p = dynamic_cast<arcsection_t const*>(s.get()))
+            {
+                eps::area_t bb = eps::arc_bounding_box(m_[p->m_a], m_[p->m_c], m_[p->m_ax] - m_[p->m_c], m_[p->m_ay] - m_[p->m_c], m_[p->m_b], epsilon);
+                eps::min_bounding_box(area.m_min, bb.m_min);
+                eps::max_bounding_box(area.m_max, bb.m_max);
+            }
+        }
+        return area;
+    }
+
+    void moveto(eps::point_t p)
+    {
+        m_.emplace_back(p);
+        m_sections.emplace_back(std::make_unique<beginpoint_t>(static_cast<int>(m_.size()) - 1));
+    }
+
+    void lineto(eps::point_t p)
+    {
+        m_.emplace_back(p);
+        m_sections.emplace_back(std::make_unique<linesection_t>(static_cast<int>(m_.size()) - 1));
+    }
+
+    void curveto(eps::point_t tangent1, eps::point_t tangent2, eps::point_t end)
+    {
+        m_.emplace_back(tangent1);
+        m_.emplace_back(tangent2);
+        m_.emplace_back(end);
+        int const n = static_cast<int>(m_.size());
+        m_sections.emplace_back(std::make_unique<beziersection_t>(n - 4, n - 3, n - 2, n - 1));
+    }
+
+    void arcto(eps::point_t center, eps::point_t x_ax, eps::point_t y_ax, eps::point_t end)
+    {
+        m_.emplace_back(center);
+        m_.emplace_back(x_ax);
+        m_.emplace_back(y_ax);
+        m_.emplace_back(end);
+        int const n = static_cast<int>(m_.size());
+        m_sections.emplace_back(std::make_unique<arcsection_t>(n - 5, n - 4, n - 3, n - 2, n - 1));
+    }
+
+    void closepath()
+    {
+        m_sections.emplace_back(std::make_unique<closepath_t>());
+    }
+
+private:
+    std::vector<eps::point_t> m_;
+    std::vector<std::unique_ptr<section_t>> m_sections;
+};
+
+}; // namespace legacy
+
+// The bench_paths path: lines, curves and arcs around (x, y).
+template<typename path_type>
+void build_path(path_type& path, float x, float y)
+{
+    path.moveto(eps::point_t(x, y));
+    for (size_t k = 1; k <= 8; ++k)
+    {
+        path.lineto(eps::point_t(x + static_cast<float>(k), y + static_cast<float>(k % 2)));
+    }
+    for (size_t k = 0; k < 4; ++k)
+    {
+        float const cx = x + 8.f - static_cast<float>(k);
+        path.curveto(eps::point_t(cx, y + 3.f), eps::point_t(cx - 0.5f, y + 3.f), eps::point_t(cx - 1.f, y + 2.f));
+    }
+    for (size_t k = 0; k < 2; ++k)
+    {
+        float const cy = y + 2.f - static_cast<float>(k);
+        path.arcto(eps::point_t(x + 4.f, cy - 0.5f), eps::point_t(x + 4.5f, cy - 0.5f), eps::point_t(x + 4.f, cy), eps::point_t(x + 4.f, cy - 1.f));
+    }
+    path.closepath();
+}
+
+// Paths of lines, curves and arcs: building them, copying them, their first
+// bounding box and drawing them. These walk the opcode array of path_t; the
+// legacy layout is timed on the same paths for reference.
+void bench_paths()
+{
+    size_t const n = 100000;
+    double build = 1e9;
+    double copy = 1e9;
+    double box = 1e9;
+    double draw = 1e9;
+    for (size_t run = 0; run < runs; ++run)
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        std::vector<std::unique_ptr<eps::path_t>> paths;
+        paths.reserve(n);
+        steady_clock::time_point const t0 = steady_clock::now();
+        for (size_t i = 0; i < n; ++i)
+        {
+            float const x = static_cast<float>(i % 1000) * 10.f;
+            float const y = static_cast<float>(i / 1000) * 10.f;
+            auto path = std::make_unique<eps::path_t>(*canvas);
+            build_path(*path, x, y);
+            paths.push_back(std::move(path));
+        }
+        steady_clock::time_point const t1 = steady_clock::now();
+        std::vector<std::unique_ptr<eps::path_t>> copies;
+        copies.reserve(n);
+        for (std::unique_ptr<eps::path_t> const& path : paths)
+        {
+            copies.push_back(std::make_unique<eps::path_t>(*path));
+        }
+        steady_clock::time_point const t2 = steady_clock::now();
+        for (std::unique_ptr<eps::path_t> const& path : paths)
+        {
+            path->bounding_box(0.001f);
+        }
+        steady_clock::time_point const t3 = steady_clock::now();
+        for (std::unique_ptr<eps::path_t>& path : paths)
+        {
+            canvas->add(std::move(path));
+        }
+        canvas->draw();
+        steady_clock::time_point const t4 = steady_clock::now();
+        build = std::min(build, seconds(t0, t1));
+        copy = std::min(copy, seconds(t1, t2));
+        box = std::min(box, seconds(t2, t3));
+        draw = std::min(draw, seconds(t3, t4));
+    }
+    std::cout << "paths: " << n << " paths of 15 segments, build " << build << " s, copy " << copy << " s, bounding box " << box << " s, draw " << draw << " s\n";
+
+    build = copy = box = 1e9;
+    for (size_t run = 0; run < runs; ++run)
+    {
+        std::vector<std::unique_ptr<legacy::path_t>> paths;
+        paths.reserve(n);
+        steady_clock::time_point const t0 = steady_clock::now();
+        for (size_t i = 0; i < n; ++i)
+        {
+            float const x = static_cast<float>(i % 1000) * 10.f;
+            float const y = static_cast<float>(i / 1000) * 10.f;
+            auto path = std::make_unique<legacy::path_t>();
+            build_path(*path, x, y);
+            paths.push_back(std::move(path));
+        }
+        steady_clock::time_point const t1 = steady_clock::now();
+        std::vector<std::unique_ptr<legacy::path_t>> copies;
+        copies.reserve(n);
+        for (std::unique_ptr<legacy::path_t> const& path : paths)
+        {
+            copies.push_back(std::make_unique<legacy::path_t>(*path));
+        }
+        steady_clock::time_point const t2 = steady_clock::now();
+        for (std::unique_ptr<legacy::path_t> const& path : paths)
+        {
+            path->bounding_box(0.001f);
+        }
+        steady_clock::time_point const t3 = steady_clock::now();
+        build = std::min(build, seconds(t0, t1));
+        copy = std::min(copy, seconds(t1, t2));
+        box = std::min(box, seconds(t2, t3));
+    }
+    std::cout << "paths (legacy sections): " << n << " paths of 15 segments, build " << build << " s, copy " << copy << " s, bounding box " << box << " s\n";
+}
+
+// Draws a canvas of paths with 1, 2, 4, ... threads, up to the cores of
+// the host, with and without instancing.
+void bench_parallel()
+{
+    size_t const n = 1000000;
+    unsigned const cores = std::max(std::thread::hardware_concurrency(), 1u);
+    for (bool instancing : { false, true })
+    {
+        for (unsigned threads = 1; threads <= cores; threads *= 2)
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            canvas->setinstancing(instancing);
+            canvas->setparallel(threads);
+            for (size_t i = 0; i < n; ++i)
+            {
+                float const x = static_cast<float>(i % 1000);
+                float const y = static_cast<float>(i / 1000);
+                auto path = std::make_unique<eps::path_t>(*canvas);
+                path->moveto(eps::point_t(x, y));
+                path->lineto(eps::point_t(x + 1.f, y));
+                path->lineto(eps::point_t(x + 1.f, y + static_cast<float>(i % 3)));
+                canvas->add(std::move(path));
+            }
+            double draw = 1e9;
+            for (size_t run = 0; run < runs; ++run)
+            {
+                steady_clock::time_point const t0 = steady_clock::now();
+                canvas->draw();
+                steady_clock::time_point const t1 = steady_clock::now();
+                sink->release();
+                draw = std::min(draw, seconds(t0, t1));
+            }
+            std::cout << "draw " << (instancing ? "instancing" : "plain     ") << ": " << n << " paths, " << threads << " threads, " << draw << " s\n";
+        }
+    }
+}
+
+}; // namespace anonymous
+
+int main()
+{
+    bench_arena();
+    bench_paths();
+    bench_parallel();
+    return 0;
+}
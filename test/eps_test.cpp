@@ -0,0 +1,1143 @@
+// Tests of the eps library. eps_test.vcxproj builds this file together with
+// the library and runs it after each build; it prints the checks that failed
+// and exits with 1 if there were any, which fails the build.
+#include "eps/eps_basic_shapes.h"
+
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace // anonymous
+{
+
+int failures = 0;
+
+#define CHECK(CONDITION) \
+    if (!(CONDITION)) \
+    { \
+        ++failures; \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #CONDITION "\n"; \
+    }
+
+struct arrow_t
+    : public eps::lineending_t
+{
+    void draw_procedure(std::ostream& stream) const override
+    {
+        stream << "/arrow { pop pop pop pop pop pop pop } bind def\n";
+    }
+    void draw(std::ostream& stream, eps::point_t p, float, float, float, float, float) const override
+    {
+        stream << p << " 0 0 0 0 0 arrow\n";
+    }
+};
+
+struct dashed_t
+    : public eps::linestyle_t
+{
+    void draw(std::ostream& stream) const override
+    {
+        stream << "[3 2] 0 setdash\n";
+    }
+};
+
+std::unique_ptr<eps::path_t> line(eps::iproperties_t const& parent, eps::point_t a, eps::point_t b, float width)
+{
+    auto path = std::make_unique<eps::path_t>(parent);
+    path->setlinewidth(width);
+    path->moveto(a);
+    path->lineto(b);
+    return path;
+}
+
+// Every draw() writes a complete document: procedures are defined again and
+// the optimizer does not assume the state the previous one left.
+void test_redraw()
+{
+    arrow_t arrow;
+    for (bool optimize : { false, true })
+    {
+        for (bool caching : { false, true })
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            canvas->setoptimize(optimize);
+            canvas->setcaching(caching);
+            auto path = line(*canvas, eps::point_t(0.f, 0.f), eps::point_t(10.f, 10.f), 0.5f);
+            path->setlineend(&arrow);
+            canvas->add(std::move(path));
+            canvas->add(line(*canvas, eps::point_t(0.f, 10.f), eps::point_t(10.f, 0.f), 0.5f));
+            // named procedures: instances of repeated paths and markers
+            canvas->setinstancing(true);
+            for (int i = 0; i < 4; ++i)
+            {
+                float const x = 20.f * static_cast<float>(i);
+                auto path = std::make_unique<eps::path_t>(*canvas);
+                path->moveto(eps::point_t(x, 20.f));
+                path->lineto(eps::point_t(x + 5.f, 25.f));
+                path->lineto(eps::point_t(x + 10.f, 20.f));
+                canvas->add(std::move(path));
+            }
+            auto markers = std::make_unique<eps::markers_t>(*canvas);
+            markers->marker().moveto(eps::point_t(-1.f, 0.f));
+            markers->marker().lineto(eps::point_t(1.f, 0.f));
+            markers->setpoints({ eps::point_t(0.f, 40.f), eps::point_t(10.f, 40.f) });
+            canvas->add(std::move(markers));
+            canvas->draw();
+            std::string const first = sink->release();
+            std::ostringstream first_report;
+            canvas->report(first_report);
+            canvas->draw();
+            std::string const second = sink->release();
+            std::ostringstream second_report;
+            canvas->report(second_report);
+            CHECK(first == second);
+            // the emission cache is empty in the first draw()
+            CHECK(caching || first_report.str() == second_report.str());
+            CHECK(second.find("/arrow") != std::string::npos);
+            CHECK(second.find("0.5 setlinewidth") != std::string::npos);
+            CHECK(second.find("/_i0") != std::string::npos);
+            CHECK(second.find("/_m1") != std::string::npos);
+        }
+    }
+}
+
+// Reordering by style keeps the painter's order of strokes that touch:
+// the lines are 3 apart, their 4 wide strokes overlap.
+void test_reorder_thick_strokes()
+{
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    canvas->setreorder(true);
+    canvas->setlinejoin(eps::join_t::round);
+    auto colored = [&canvas](eps::point_t a, eps::point_t b, float blue)
+    {
+        auto path = line(*canvas, a, b, 4.f);
+        path->setlinergbcolor(1.f - blue, 0.f, blue);
+        canvas->add(std::move(path));
+    };
+    colored(eps::point_t(0.f, 100.f), eps::point_t(17.f, 100.f), 1.f);
+    colored(eps::point_t(0.f, 0.f), eps::point_t(11.f, 0.f), 0.f);
+    colored(eps::point_t(0.f, 3.f), eps::point_t(13.f, 3.f), 1.f);
+    colored(eps::point_t(0.f, 200.f), eps::point_t(19.f, 200.f), 0.f);
+    canvas->draw();
+    std::string const document = sink->release();
+    size_t const below = document.find("11 0 lineto");
+    size_t const above = document.find("13 3 lineto");
+    CHECK(below != std::string::npos);
+    CHECK(above != std::string::npos);
+    CHECK(below < above);
+    // the strokes far away are still grouped by color
+    CHECK(document.find("19 200 lineto") < above);
+}
+
+// A line outside the viewport whose stroke reaches into it is drawn, with
+// and without the spatial index; intersecting() finds it as well.
+void test_viewport_thick_stroke()
+{
+    for (bool indexing : { false, true })
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        canvas->setindexing(indexing);
+        canvas->setviewport(eps::area_t(eps::point_t(0.f, 0.f), eps::point_t(100.f, 100.f)));
+        canvas->setlinejoin(eps::join_t::round);
+        canvas->add(line(*canvas, eps::point_t(10.f, -3.f), eps::point_t(90.f, -3.f), 8.f));
+        canvas->add(line(*canvas, eps::point_t(10.f, -30.f), eps::point_t(90.f, -30.f), 8.f));
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(document.find("90 -3 lineto") != std::string::npos);
+        CHECK(document.find("90 -30 lineto") == std::string::npos);
+        CHECK(canvas->intersecting(eps::area_t(eps::point_t(0.f, 0.f), eps::point_t(100.f, 100.f)), 0.001f).size() == 1);
+    }
+}
+
+// The spatial indices of nested groups follow the line widths of the
+// shapes in them, whether set on a shape, on its group or inherited from
+// the canvas: the thicker strokes reach into the viewport.
+void test_viewport_index_styles()
+{
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    canvas->setindexing(true);
+    canvas->setviewport(eps::area_t(eps::point_t(0.f, 0.f), eps::point_t(100.f, 100.f)));
+    canvas->setlinejoin(eps::join_t::round);
+    auto nested = [&canvas](float y)
+    {
+        auto group = std::make_unique<eps::group_t>(static_cast<eps::iproperties_t const&>(*canvas));
+        group->setindexing(true);
+        auto path = std::make_unique<eps::path_t>(*group);
+        path->moveto(eps::point_t(10.f, y));
+        path->lineto(eps::point_t(90.f, y));
+        eps::path_t* const child = path.get();
+        group->add(std::move(path));
+        eps::group_t* const owner = group.get();
+        canvas->add(std::move(group));
+        return std::make_pair(owner, child);
+    };
+    auto const set = nested(-3.f);
+    nested(-5.f);
+    auto drawn = [&canvas, &sink](char const* lineto)
+    {
+        canvas->draw();
+        return sink->release().find(lineto) != std::string::npos;
+    };
+    CHECK(!drawn("90 -3 lineto"));
+    // on the shape
+    set.second->setlinewidth(8.f);
+    CHECK(drawn("90 -3 lineto"));
+    set.second->setlinewidth(1.f);
+    CHECK(!drawn("90 -3 lineto"));
+    // on its group, which the shape overrides
+    set.first->setlinewidth(8.f);
+    CHECK(!drawn("90 -3 lineto"));
+    // on the canvas, inherited by the other group and its shape only
+    CHECK(!drawn("90 -5 lineto"));
+    canvas->setlinewidth(12.f);
+    CHECK(drawn("90 -5 lineto"));
+    CHECK(!drawn("90 -3 lineto"));
+    canvas->setlinewidth(1.f);
+    CHECK(!drawn("90 -5 lineto"));
+}
+
+// A dashed path that leaves and enters the viewport again is not cut:
+// the pieces would each start the dash pattern anew.
+void test_viewport_dashed()
+{
+    dashed_t dashed;
+    for (bool dash : { false, true })
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        canvas->setviewport(eps::area_t(eps::point_t(0.f, 0.f), eps::point_t(100.f, 100.f)));
+        auto path = std::make_unique<eps::path_t>(*canvas);
+        if (dash)
+        {
+            path->setlinestyle(&dashed);
+        }
+        path->moveto(eps::point_t(10.f, 10.f));
+        path->lineto(eps::point_t(500.f, 10.f));
+        path->lineto(eps::point_t(500.f, 20.f));
+        path->lineto(eps::point_t(10.f, 20.f));
+        canvas->add(std::move(path));
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK((document.find("500 10 lineto") != std::string::npos) == dash);
+    }
+}
+
+size_t count(std::string const& text, std::string const& word)
+{
+    size_t n = 0;
+    for (size_t i = text.find(word); i != std::string::npos; i = text.find(word, i + word.size()))
+    {
+        ++n;
+    }
+    return n;
+}
+
+// Points that are written the same as the previous one are dropped, with
+// and without simplification and at any precision; the last point stays,
+// unless the simplification drops the point before it.
+void test_polyline_same_output()
+{
+    for (int decimals : { -1, 2 })
+    {
+        for (bool simplify : { false, true })
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            if (decimals >= 0)
+            {
+                canvas->setprecision(decimals);
+            }
+            canvas->setsimplify(simplify);
+            auto path = std::make_unique<eps::path_t>(*canvas);
+            path->moveto(eps::point_t(0.f, 0.f));
+            path->lineto(eps::point_t(100.f, 100.f));
+            path->lineto(eps::point_t(100.0001f, 100.f));
+            path->lineto(eps::point_t(200.f, 0.f));
+            path->lineto(eps::point_t(200.0001f, 0.f));
+            canvas->add(std::move(path));
+            canvas->draw();
+            std::string const document = sink->release();
+            CHECK(count(document, "100 100 lineto") == 1);
+            CHECK(count(document, "200 0 lineto") == (simplify ? 1 : 2));
+        }
+    }
+}
+
+// Threads that add to the producers of a canvas and of a nested group at
+// the same time: after drawing, each group holds all shapes, producer by
+// producer in the order of their ids, each in the order it was added.
+void test_producers()
+{
+    unsigned const producers = 8;
+    size_t const n = 2000;
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    auto owned = std::make_unique<eps::group_t>(static_cast<eps::iproperties_t const&>(*canvas));
+    eps::group_t* const group = owned.get();
+    canvas->add(std::move(owned));
+    std::vector<std::vector<eps::shape_t*>> added(producers);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < producers; ++t)
+    {
+        // the ids count down, so that merging cannot follow the start order
+        unsigned const id = producers - 1 - t;
+        eps::group_t* const target = t % 2 ? group : canvas.get();
+        threads.emplace_back([&added, id, target, n, producers]()
+        {
+            eps::group_t::producer_t& producer = target->producer(id);
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto path = line(*target, eps::point_t(static_cast<float>(id), static_cast<float>(i)),
+                    eps::point_t(static_cast<float>(id), static_cast<float>(i) + 0.5f), 1.f);
+                path->setlinergbcolor(static_cast<float>(id) / producers, 0.f, 0.f);
+                added[id].push_back(path.get());
+                producer.add(std::move(path));
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    canvas->draw();
+    std::string const document = sink->release();
+    CHECK(count(document, " moveto") == producers * n);
+    eps::area_t const everywhere(eps::point_t(-1e6f, -1e6f), eps::point_t(1e6f, 1e6f));
+    for (eps::group_t* target : { static_cast<eps::group_t*>(canvas.get()), group })
+    {
+        std::vector<eps::shape_t*> expected;
+        if (target == canvas.get())
+        {
+            expected.push_back(group);
+        }
+        for (unsigned id = 0; id < producers; ++id)
+        {
+            if ((producers - 1 - id) % 2 == (target == group))
+            {
+                expected.insert(expected.end(), added[id].begin(), added[id].end());
+            }
+        }
+        CHECK(target->intersecting(everywhere, 0.001f) == expected);
+    }
+}
+
+// A scene large enough to be drawn in parallel: repeated geometry that
+// instancing turns into procedures, changing styles, curves and markers.
+void build_scene(eps::canvas_t& canvas)
+{
+    for (size_t i = 0; i < 5000; ++i)
+    {
+        float const x = static_cast<float>(i % 100) * 10.f;
+        float const y = static_cast<float>(i / 100) * 10.f;
+        if (i % 97 == 0)
+        {
+            auto markers = std::make_unique<eps::markers_t>(canvas);
+            markers->marker().moveto(eps::point_t(-1.f, -1.f));
+            markers->marker().lineto(eps::point_t(1.f, 1.f));
+            markers->setpoints({ eps::point_t(x, y), eps::point_t(x + 3.f, y + 3.f) });
+            canvas.add(std::move(markers));
+            continue;
+        }
+        auto path = std::make_unique<eps::path_t>(canvas);
+        path->moveto(eps::point_t(x, y));
+        if (i % 3)
+        {
+            path->lineto(eps::point_t(x + 5.f, y));
+            path->lineto(eps::point_t(x + 5.f, y + 5.f));
+        }
+        else
+        {
+            path->curveto(eps::point_t(x + 2.f, y + 4.f), eps::point_t(x + 4.f, y + 4.f), eps::point_t(x + 6.f, y + static_cast<float>(i % 7)));
+        }
+        if (i % 11 == 0)
+        {
+            path->setlinewidth(static_cast<float>(i % 5) + 0.5f);
+        }
+        if (i % 13 == 0)
+        {
+            path->setlinergbcolor(0.f, static_cast<float>(i % 4) / 4.f, 0.f);
+        }
+        canvas.add(std::move(path));
+    }
+}
+
+// Drawing in parallel writes the same bytes as drawing serially.
+void test_parallel()
+{
+    for (bool instancing : { false, true })
+    {
+        std::string serial;
+        for (unsigned threads : { 1u, 2u, 3u, 7u })
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            canvas->setinstancing(instancing);
+            canvas->setparallel(threads);
+            build_scene(*canvas);
+            canvas->draw();
+            std::string const document = sink->release();
+            if (threads == 1)
+            {
+                serial = document;
+                CHECK(document.find("/_m") != std::string::npos);
+                CHECK((document.find("/_i") != std::string::npos) == instancing);
+                continue;
+            }
+            CHECK(document == serial);
+        }
+    }
+}
+
+void extend(eps::area_t& area, eps::area_t const& other)
+{
+    eps::min_bounding_box(area.m_min, other.m_min);
+    eps::max_bounding_box(area.m_max, other.m_max);
+}
+
+bool near(eps::area_t const& a, eps::area_t const& b, float tolerance)
+{
+    return std::fabs(a.m_min.m_x - b.m_min.m_x) <= tolerance && std::fabs(a.m_min.m_y - b.m_min.m_y) <= tolerance &&
+        std::fabs(a.m_max.m_x - b.m_max.m_x) <= tolerance && std::fabs(a.m_max.m_y - b.m_max.m_y) <= tolerance;
+}
+
+// The bounding box of a path, which runs the vectorized kernels over runs
+// of curves and arcs, is the union of the boxes of its segments one by
+// one. The runs are 1 to 17 segments long, so most of them end in a
+// partial vector.
+void test_bounding_box_runs()
+{
+    std::mt19937 random(25);
+    std::uniform_real_distribution<float> coordinate(-100.f, 100.f);
+    std::uniform_real_distribution<float> radius(0.1f, 50.f);
+    std::uniform_real_distribution<float> angle(-7.f, 7.f);
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    float const epsilon = 0.001f;
+    for (size_t test = 0; test < 200; ++test)
+    {
+        eps::path_t path(*canvas);
+        eps::point_t current(coordinate(random), coordinate(random));
+        path.moveto(current);
+        eps::area_t expected(current, current);
+        for (size_t run = 0; run < 4; ++run)
+        {
+            size_t const n = 1 + (test + run) % 17;
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (run % 2)
+                {
+                    // an ellipse through the current point, from there to
+                    // a point further along it
+                    eps::vect_t const rx(radius(random), coordinate(random) / 10.f);
+                    eps::vect_t const ry(coordinate(random) / 10.f, radius(random));
+                    float const begin = angle(random);
+                    float const end = angle(random);
+                    eps::point_t const center(current.m_x - rx.m_x * std::cos(begin) - ry.m_x * std::sin(begin),
+                        current.m_y - rx.m_y * std::cos(begin) - ry.m_y * std::sin(begin));
+                    eps::point_t const b(center.m_x + rx.m_x * std::cos(end) + ry.m_x * std::sin(end),
+                        center.m_y + rx.m_y * std::cos(end) + ry.m_y * std::sin(end));
+                    path.arcto(center, eps::point_t(center.m_x + rx.m_x, center.m_y + rx.m_y),
+                        eps::point_t(center.m_x + ry.m_x, center.m_y + ry.m_y), b);
+                    extend(expected, eps::arc_bounding_box(current, center, rx, ry, b, epsilon));
+                    current = b;
+                }
+                else
+                {
+                    eps::point_t const ai(coordinate(random), coordinate(random));
+                    eps::point_t const bi(coordinate(random), coordinate(random));
+                    eps::point_t const b(coordinate(random), coordinate(random));
+                    path.curveto(ai, bi, b);
+                    extend(expected, eps::bezier_bounding_box(current, ai, bi, b, epsilon));
+                    current = b;
+                }
+            }
+            current = eps::point_t(coordinate(random), coordinate(random));
+            path.lineto(current);
+            extend(expected, eps::area_t(current, current));
+        }
+        CHECK(near(path.bounding_box(epsilon), expected, 1e-3f));
+    }
+}
+
+// A canvas with styled paths and a line ending that all canvases share.
+std::string draw_styled(eps::lineending_t* lineend)
+{
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    for (size_t i = 0; i < 200; ++i)
+    {
+        auto path = line(*canvas, eps::point_t(static_cast<float>(i), 0.f), eps::point_t(static_cast<float>(i), 10.f),
+            static_cast<float>(i % 5) + 0.5f);
+        path->setlinergbcolor(static_cast<float>(i % 3) / 3.f, 0.f, 0.f);
+        if (i % 10 == 0)
+        {
+            path->setlineend(lineend);
+        }
+        canvas->add(std::move(path));
+    }
+    canvas->draw();
+    return sink->release();
+}
+
+// Canvases that are built and drawn on many threads at once each write the
+// same document as one drawn alone, procedures of shared line endings
+// included.
+void test_canvases_on_threads()
+{
+    arrow_t arrow;
+    std::string const expected = draw_styled(&arrow);
+    CHECK(expected.find("/arrow") != std::string::npos);
+    unsigned const threads = 8;
+    size_t const canvases = 20;
+    std::vector<size_t> different(threads, 0);
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        pool.emplace_back([&arrow, &expected, &different, t, canvases]()
+        {
+            for (size_t i = 0; i < canvases; ++i)
+            {
+                different[t] += draw_styled(&arrow) != expected;
+            }
+        });
+    }
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+    for (size_t d : different)
+    {
+        CHECK(d == 0);
+    }
+}
+
+// A path cannot start with a curve or an arc, they begin at the current
+// point.
+void test_no_current_point()
+{
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    for (bool arc : { false, true })
+    {
+        eps::path_t path(*canvas);
+        bool thrown = false;
+        try
+        {
+            if (arc)
+            {
+                path.arcto(eps::point_t(0.f, 0.f), eps::point_t(1.f, 0.f), eps::point_t(0.f, 1.f), eps::point_t(0.f, 1.f));
+            }
+            else
+            {
+                path.curveto(eps::point_t(0.f, 1.f), eps::point_t(1.f, 1.f), eps::point_t(1.f, 0.f));
+            }
+        }
+        catch (std::logic_error const& e)
+        {
+            thrown = std::string(e.what()).find("E0106") != std::string::npos;
+        }
+        CHECK(thrown);
+        path.moveto(eps::point_t(1.f, 0.f));
+        path.arcto(eps::point_t(0.f, 0.f), eps::point_t(1.f, 0.f), eps::point_t(0.f, 1.f), eps::point_t(0.f, 1.f));
+        path.curveto(eps::point_t(0.f, 2.f), eps::point_t(1.f, 2.f), eps::point_t(1.f, 1.f));
+    }
+}
+
+// A streaming canvas draws what is added within its viewport, like a
+// buffered one: groups skip the shapes outside, long strokes are cut.
+void test_streaming_viewport()
+{
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink, eps::canvas_mode_t::streaming);
+    canvas->setviewport(eps::area_t(eps::point_t(0.f, 0.f), eps::point_t(100.f, 100.f)));
+    auto group = std::make_unique<eps::group_t>(static_cast<eps::iproperties_t const&>(*canvas));
+    group->add(line(*group, eps::point_t(10.f, 10.f), eps::point_t(20.f, 20.f), 1.f));
+    group->add(line(*group, eps::point_t(1000.f, 10.f), eps::point_t(1010.f, 20.f), 1.f));
+    canvas->add(std::move(group));
+    canvas->add(line(*canvas, eps::point_t(50.f, 50.f), eps::point_t(10000.f, 50.f), 1.f));
+    canvas->draw();
+    std::string const document = sink->release();
+    CHECK(document.find("20 20 lineto") != std::string::npos);
+    CHECK(document.find("1010 20") == std::string::npos);
+    CHECK(document.find("10000 50") == std::string::npos);
+}
+
+// Resolved styles follow changes of the parent and of the shape itself,
+// also when overrides are erased and new ones take their place.
+void test_resolved_styles()
+{
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    auto owned = std::make_unique<eps::group_t>(static_cast<eps::iproperties_t const&>(*canvas));
+    eps::group_t* const group = owned.get();
+    canvas->add(std::move(owned));
+    group->setlinewidth(2.f);
+    auto path = line(*group, eps::point_t(0.f, 0.f), eps::point_t(1.f, 1.f), 1.f);
+    eps::path_t* const child = path.get();
+    group->add(std::move(path));
+    child->setlinergbcolor(0.5f, 0.f, 0.f);
+    CHECK(child->linewidth() == 1.f);
+    CHECK(canvas->linewidth() == 1.f);
+    for (size_t round = 0; round < 50; ++round)
+    {
+        float const width = static_cast<float>(round) + 0.5f;
+        std::vector<std::unique_ptr<eps::path_t>> paths;
+        for (size_t i = 0; i < 20; ++i)
+        {
+            paths.push_back(std::make_unique<eps::path_t>(*group));
+            paths.back()->setlinergbcolor(static_cast<float>(i) / 20.f, width / 50.f, 0.f);
+        }
+        group->setlinewidth(width);
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            CHECK(paths[i]->linewidth() == width);
+            CHECK(paths[i]->linercolor() == static_cast<float>(i) / 20.f);
+            CHECK(paths[i]->linegcolor() == width / 50.f);
+        }
+    }
+}
+
+// Resolved styles go with the last shape that has them; a style created
+// later in their place is still written. The streamed lines are released
+// one by one, and the lines of the cached canvas change color between
+// draws.
+void test_released_styles()
+{
+    auto sink = eps::create_memory_sink();
+    auto streaming = eps::create_canvas(*sink, eps::canvas_mode_t::streaming);
+    for (size_t i = 0; i < 200; ++i)
+    {
+        float const x = static_cast<float>(i);
+        auto path = line(*streaming, eps::point_t(x, 0.f), eps::point_t(x, 1.f), 1.f);
+        path->setlinergbcolor(static_cast<float>(i % 2), 0.f, 0.5f);
+        streaming->add(std::move(path));
+    }
+    streaming->draw();
+    CHECK(count(sink->release(), "setrgbcolor") == 200);
+
+    auto canvas = eps::create_canvas(*sink);
+    canvas->setcaching(true);
+    std::vector<eps::path_t*> lines;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        float const x = static_cast<float>(i);
+        auto path = line(*canvas, eps::point_t(x, 0.f), eps::point_t(x, 1.f), 1.f);
+        lines.push_back(path.get());
+        canvas->add(std::move(path));
+    }
+    for (size_t round = 0; round < 50; ++round)
+    {
+        for (size_t i = 0; i < lines.size(); ++i)
+        {
+            lines[i]->setlinergbcolor(static_cast<float>((round + i) % 2), 0.f, 0.5f);
+        }
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(count(document, "setrgbcolor") == 4);
+        CHECK(document.find(round % 2 ? "0 1 lineto\n1 0 0.5 setrgbcolor" : "0 1 lineto\n0 0 0.5 setrgbcolor") != std::string::npos);
+    }
+}
+
+// A canvas draws the same from its arena as from the heap, with shapes
+// made in the arena, shapes from the heap whose points are in the arena
+// and groups; with caching they keep an emission. Tearing it down leaves
+// nothing behind, which the sanitizer builds check.
+void test_arena()
+{
+    for (bool caching : { false, true })
+    {
+        std::string documents[2];
+        for (bool arena : { false, true })
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            canvas->setarena(arena);
+            canvas->setcaching(caching);
+            auto group = canvas->make<eps::group_t>(static_cast<eps::iproperties_t const&>(*canvas));
+            for (size_t i = 0; i < 100; ++i)
+            {
+                float const x = static_cast<float>(i);
+                auto made = canvas->make<eps::path_t>(*canvas);
+                made->moveto(eps::point_t(x, 0.f));
+                made->lineto(eps::point_t(x + 1.f, 1.f));
+                made->setlinewidth(static_cast<float>(i % 3) + 1.f);
+                canvas->add(std::move(made));
+                group->add(line(*group, eps::point_t(x, 2.f), eps::point_t(x + 1.f, 3.f), 0.5f));
+            }
+            canvas->add(std::move(group));
+            canvas->draw();
+            documents[arena] = sink->release();
+        }
+        CHECK(documents[0] == documents[1]);
+        CHECK(count(documents[1], "setlinewidth") == 100);
+    }
+}
+
+// A file descriptor sink whose writes fail reports it to the stream
+// instead of retrying.
+void test_fd_sink_error()
+{
+    auto sink = eps::create_fd_sink(-1, 4096);
+    std::ostream out(sink.get());
+    out << std::string(10000, 'x');
+    out.flush();
+    CHECK(!out);
+}
+
+// Every drawn shape is in the emission cache statistics of the last draw():
+// shapes drawn in parallel or through instance procedures count as drawn,
+// not reused.
+void test_cache_report()
+{
+    for (unsigned threads : { 1u, 2u })
+    {
+        for (bool instancing : { false, true })
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            canvas->setcaching(true);
+            canvas->setinstancing(instancing);
+            canvas->setparallel(threads);
+            for (size_t i = 0; i < 3000; ++i)
+            {
+                float const x = static_cast<float>(i);
+                auto path = line(*canvas, eps::point_t(x, 0.f), eps::point_t(x + 1.f, 1.f), 1.f);
+                path->lineto(eps::point_t(x + 2.f, 0.f));
+                path->lineto(eps::point_t(x + 3.f, 5.f));
+                canvas->add(std::move(path));
+            }
+            canvas->draw();
+            canvas->draw();
+            std::ostringstream report;
+            canvas->report(report);
+            bool const bypassed = threads > 1 || instancing;
+            CHECK(report.str().find(bypassed ? "emission cache: 0 of 3000 shapes reused" : "emission cache: 3000 of 3000 shapes reused") != std::string::npos);
+            CHECK((report.str().find("3000 of them drawn in parallel or as instances") != std::string::npos) == bypassed);
+        }
+    }
+}
+
+// Copies of a path at other places share one instance procedure, although
+// their coordinates relative to the first point differ in the last bits.
+// Copies that reach outside the viewport are drawn themselves, clipped.
+// Instancing is off unless it is asked for.
+void test_instancing()
+{
+    auto copies = [](eps::canvas_t& canvas, size_t n)
+    {
+        for (size_t k = 0; k < n; ++k)
+        {
+            float const x = 10.f * static_cast<float>(k);
+            auto path = std::make_unique<eps::path_t>(canvas);
+            path->moveto(eps::point_t(x, 0.f));
+            path->lineto(eps::point_t(x + 0.7f, 2.9f));
+            path->lineto(eps::point_t(x + 1.9f, 0.3f));
+            path->lineto(eps::point_t(x + 3.1f, 2.2f));
+            path->lineto(eps::point_t(x + 4.3f, 0.1f));
+            canvas.add(std::move(path));
+        }
+    };
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        canvas->setinstancing(true);
+        copies(*canvas, 8);
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(count(document, "bind def") == 1);
+        CHECK(count(document, " _i0\n") == 8);
+        CHECK(document.find("0.7 2.9 lineto") != std::string::npos);
+    }
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        canvas->setinstancing(true);
+        canvas->setviewport(eps::area_t(eps::point_t(-20.f, -20.f), eps::point_t(42.f, 20.f)));
+        copies(*canvas, 8);
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(count(document, " _i0\n") == 4);
+        CHECK(document.find("40 0 moveto") != std::string::npos);
+        CHECK(document.find("50 0 moveto") == std::string::npos);
+    }
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        copies(*canvas, 8);
+        canvas->draw();
+        CHECK(sink->release().find("/_i") == std::string::npos);
+    }
+}
+
+// The elements of one /_mNd array, one chunk of markers.
+std::vector<std::string> marker_chunk(std::string const& document, size_t begin)
+{
+    size_t const open = document.find('[', begin);
+    std::istringstream elements(document.substr(open + 1, document.find(']', open) - open - 1));
+    std::vector<std::string> chunk;
+    for (std::string element; elements >> element;)
+    {
+        chunk.push_back(element);
+    }
+    return chunk;
+}
+
+// Markers are written as one procedure for the marker, one for the loop
+// body and arrays of at most 65535 elements that the loop runs over.
+void test_markers()
+{
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        auto markers = std::make_unique<eps::markers_t>(*canvas);
+        markers->marker().moveto(eps::point_t(-1.f, -1.f));
+        markers->marker().lineto(eps::point_t(1.f, -1.f));
+        markers->marker().lineto(eps::point_t(1.f, 1.f));
+        markers->marker().closepath();
+        markers->setfill(true);
+        markers->setpoints({ eps::point_t(0.f, 0.f), eps::point_t(10.f, 0.f), eps::point_t(5.f, 20.f) });
+        markers->setsizes({ 1.f, 2.f, 3.f });
+        markers->setcolors({ 0, 1, 0 }, { 1.f, 0.f, 0.f, 0.f, 0.f, 1.f });
+        // the marker extent scaled by the size around each point
+        eps::area_t const area = markers->bounding_box(0.001f);
+        CHECK(area.m_min.m_x == -1.f);
+        CHECK(area.m_min.m_y == -2.f);
+        CHECK(area.m_max.m_x == 12.f);
+        CHECK(area.m_max.m_y == 23.f);
+        canvas->add(std::move(markers));
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(document.find("%%BoundingBox: -1 -2 12 23") != std::string::npos);
+        CHECK(document.find("/_m0 {\n-1 -1 moveto") != std::string::npos);
+        CHECK(document.find("/_m0c [\n[1 0 0]\n[0 0 1]\n] def") != std::string::npos);
+        CHECK(document.find("/_m0l { _m0d exch 4 getinterval aload pop _m0c exch get aload pop setrgbcolor ") != std::string::npos);
+        CHECK(document.find("dup scale newpath _m0 setmatrix fill } bind def") != std::string::npos);
+        CHECK(document.find("0 4 _m0d length 1 sub /_m0l load for") != std::string::npos);
+        std::vector<std::string> const chunk = marker_chunk(document, document.find("/_m0d ["));
+        CHECK((chunk == std::vector<std::string>{ "0", "0", "1", "0", "10", "0", "2", "1", "5", "20", "3", "0" }));
+    }
+    // colors and sizes that do not match the points are left out
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        auto markers = std::make_unique<eps::markers_t>(*canvas);
+        markers->marker().moveto(eps::point_t(-1.f, 0.f));
+        markers->marker().lineto(eps::point_t(1.f, 0.f));
+        markers->setpoints({ eps::point_t(0.f, 0.f), eps::point_t(10.f, 0.f) });
+        markers->setsizes({ 2.f });
+        markers->setcolors({ 0, 0 }, {});
+        canvas->add(std::move(markers));
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(document.find("/_m0c") == std::string::npos);
+        CHECK(document.find("setrgbcolor") == std::string::npos);
+        CHECK(document.find("/_m0l { _m0d exch 2 getinterval aload pop matrix currentmatrix 3 1 roll translate newpath _m0 setmatrix stroke } bind def") != std::string::npos);
+        CHECK((marker_chunk(document, document.find("/_m0d [")) == std::vector<std::string>{ "0", "0", "10", "0" }));
+    }
+    // 40000 markers take one loop over 2 elements each, two over 4
+    for (bool styled : { false, true })
+    {
+        size_t const n = 40000;
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        auto markers = std::make_unique<eps::markers_t>(*canvas);
+        markers->marker().moveto(eps::point_t(-1.f, 0.f));
+        markers->marker().lineto(eps::point_t(1.f, 0.f));
+        std::vector<eps::point_t> points;
+        for (size_t i = 0; i < n; ++i)
+        {
+            points.emplace_back(static_cast<float>(i % 200), static_cast<float>(i / 200));
+        }
+        markers->setpoints(std::move(points));
+        if (styled)
+        {
+            markers->setsizes(std::vector<float>(n, 2.f));
+            markers->setcolors(std::vector<uint8_t>(n, 0), { 0.f, 1.f, 0.f });
+        }
+        canvas->add(std::move(markers));
+        canvas->draw();
+        std::string const document = sink->release();
+        size_t const stride = styled ? 4 : 2;
+        size_t const chunks = styled ? 3 : 2;
+        CHECK(count(document, "/_m0d [") == chunks);
+        CHECK(count(document, "_m0d length 1 sub /_m0l load for") == chunks);
+        size_t elements = 0;
+        for (size_t i = document.find("/_m0d ["); i != std::string::npos; i = document.find("/_m0d [", i + 1))
+        {
+            size_t const size = marker_chunk(document, i).size();
+            CHECK(size <= 65535);
+            CHECK(size % stride == 0);
+            elements += size;
+        }
+        CHECK(elements == stride * n);
+    }
+}
+
+// Decodes the ASCII85 data that follows begin in the text, up to ~>.
+std::vector<uint8_t> ascii85_decode(std::string const& text, size_t begin)
+{
+    std::vector<uint8_t> bytes;
+    uint32_t group = 0;
+    size_t digits = 0;
+    auto put = [&bytes](uint32_t v, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            bytes.push_back(static_cast<uint8_t>(v >> (24 - 8 * i)));
+        }
+    };
+    for (size_t i = begin; i < text.size() && text[i] != '~'; ++i)
+    {
+        char const c = text[i];
+        if (c == 'z' && !digits)
+        {
+            put(0, 4);
+        }
+        else if (c >= '!' && c <= 'u')
+        {
+            group = group * 85 + static_cast<uint32_t>(c - '!');
+            if (++digits == 5)
+            {
+                put(group, 4);
+                group = 0;
+                digits = 0;
+            }
+        }
+    }
+    if (digits)
+    {
+        for (size_t i = digits; i < 5; ++i)
+        {
+            group = group * 85 + 84;
+        }
+        put(group, digits - 1);
+    }
+    return bytes;
+}
+
+// Decodes PostScript RunLength data up to its end of data marker.
+std::vector<uint8_t> runlength_decode(std::vector<uint8_t> const& data)
+{
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < data.size() && data[i] != 128;)
+    {
+        size_t const length = data[i++];
+        if (length < 128)
+        {
+            bytes.insert(bytes.end(), data.begin() + i, data.begin() + i + length + 1);
+            i += length + 1;
+        }
+        else
+        {
+            bytes.insert(bytes.end(), 257 - length, data[i++]);
+        }
+    }
+    return bytes;
+}
+
+// The pixels an image writes decode back to the input, through ASCII85
+// and RunLength, in gray and in rgb. The pixels mix noise, zeros that
+// ASCII85 writes as z and runs longer than a RunLength run.
+void test_image()
+{
+    std::mt19937 random(7);
+    for (int components : { 1, 3 })
+    {
+        int const width = 200;
+        int const height = 100;
+        std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * components);
+        for (size_t i = 0; i < pixels.size(); ++i)
+        {
+            size_t const row = i / (static_cast<size_t>(width) * components);
+            pixels[i] = row % 3 == 0 ? static_cast<uint8_t>(random()) : row % 3 == 1 ? 0 : static_cast<uint8_t>(row);
+        }
+        for (bool runlength : { false, true })
+        {
+            auto sink = eps::create_memory_sink();
+            auto canvas = eps::create_canvas(*sink);
+            auto image = std::make_unique<eps::image_t>(*canvas);
+            image->setpixels(pixels.data(), width, height, components);
+            image->setarea(eps::area_t(eps::point_t(10.f, 20.f), eps::point_t(30.f, 50.f)));
+            image->setrunlength(runlength);
+            eps::area_t const area = image->bounding_box(0.001f);
+            CHECK(area.m_min.m_x == 10.f);
+            CHECK(area.m_min.m_y == 20.f);
+            CHECK(area.m_max.m_x == 30.f);
+            CHECK(area.m_max.m_y == 50.f);
+            canvas->add(std::move(image));
+            canvas->draw();
+            std::string const document = sink->release();
+            CHECK(document.find("%%BoundingBox: 10 20 30 50") != std::string::npos);
+            CHECK(document.find("[20 0 0 30 10 20] concat\n200 100 8 [200 0 0 -100 0 100]\n") != std::string::npos);
+            std::string const filters = runlength ? "currentfile /ASCII85Decode filter /RunLengthDecode filter" : "currentfile /ASCII85Decode filter";
+            std::string const header = filters + (components == 3 ? " false 3 colorimage\n" : " image\n");
+            size_t const begin = document.find(header);
+            CHECK(begin != std::string::npos);
+            CHECK(count(document, "colorimage") == (components == 3 ? 1u : 0u));
+            if (begin != std::string::npos)
+            {
+                std::vector<uint8_t> const data = ascii85_decode(document, begin + header.size());
+                CHECK((runlength ? runlength_decode(data) : data) == pixels);
+                CHECK(!runlength || data.size() < pixels.size());
+            }
+        }
+    }
+    auto sink = eps::create_memory_sink();
+    auto canvas = eps::create_canvas(*sink);
+    eps::image_t image(*canvas);
+    uint8_t const pixels[2] = { 0, 0 };
+    bool thrown = false;
+    try
+    {
+        image.setpixels(pixels, 1, 1, 2);
+    }
+    catch (std::invalid_argument const& e)
+    {
+        thrown = std::string(e.what()).find("E0102") != std::string::npos;
+    }
+    CHECK(thrown);
+}
+
+// The records of a mesh as (flag, x, y, red): the ASCII85 data after
+// shfill holds an 8 bit flag when flags is set, 16 bit coordinates and
+// three 8 bit color components per vertex.
+std::vector<std::vector<int>> mesh_records(std::string const& document, bool flags)
+{
+    std::string const source = "/DataSource currentfile /ASCII85Decode filter >> shfill\n";
+    std::vector<uint8_t> const data = ascii85_decode(document, document.find(source) + source.size());
+    size_t const size = flags ? 8 : 7;
+    std::vector<std::vector<int>> records;
+    for (size_t i = 0; i + size <= data.size(); i += size)
+    {
+        uint8_t const* r = &data[i] + flags;
+        records.push_back({ flags ? data[i] : -1, r[0] << 8 | r[1], r[2] << 8 | r[3], r[4] });
+    }
+    return records;
+}
+
+// Free-form triangles that continue a strip or a fan only write their new
+// vertex, flagged 1 or 2; others write all three flagged 0. The vertices
+// are on a 10 grid over a 20 x 10 box, colored red by index.
+void test_mesh()
+{
+    std::vector<eps::point_t> const vertices = {
+        eps::point_t(0.f, 0.f), eps::point_t(10.f, 0.f), eps::point_t(0.f, 10.f),
+        eps::point_t(10.f, 10.f), eps::point_t(20.f, 0.f), eps::point_t(20.f, 10.f) };
+    std::vector<float> colors;
+    for (size_t i = 0; i < vertices.size(); ++i)
+    {
+        colors.insert(colors.end(), { static_cast<float>(i) / 5.f, 0.f, 1.f });
+    }
+    // the record of vertex i with a flag
+    auto record = [](int flag, size_t i)
+    {
+        int const x[] = { 0, 32768, 0, 32768, 65535, 65535 };
+        int const y[] = { 0, 0, 65535, 65535, 0, 65535 };
+        int const red[] = { 0, 51, 102, 153, 204, 255 };
+        return std::vector<int>{ flag, x[i], y[i], red[i] };
+    };
+    struct
+    {
+        std::vector<uint32_t> triangles;
+        std::vector<std::vector<int>> records;
+    } const cases[] = {
+        { { 0, 1, 2, 1, 2, 3, 2, 3, 4 }, { record(0, 0), record(0, 1), record(0, 2), record(1, 3), record(1, 4) } },
+        { { 1, 0, 2, 1, 2, 3, 1, 3, 5 }, { record(0, 1), record(0, 0), record(0, 2), record(2, 3), record(2, 5) } },
+        { { 0, 1, 2, 3, 4, 5 }, { record(0, 0), record(0, 1), record(0, 2), record(0, 3), record(0, 4), record(0, 5) } },
+    };
+    for (auto const& c : cases)
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        auto mesh = std::make_unique<eps::mesh_t>(*canvas);
+        mesh->setvertices(vertices, colors);
+        mesh->settriangles(c.triangles);
+        canvas->add(std::move(mesh));
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(document.find("<< /ShadingType 4 /ColorSpace /DeviceRGB /BitsPerCoordinate 16 /BitsPerComponent 8 /BitsPerFlag 8\n/Decode [0 20 0 10 0 1 0 1 0 1]\n") != std::string::npos);
+        CHECK(mesh_records(document, true) == c.records);
+    }
+    // a lattice writes whole rows of vertices without flags
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        auto mesh = std::make_unique<eps::mesh_t>(*canvas);
+        mesh->setvertices(vertices, colors);
+        mesh->settriangles({ 0, 1, 2 });
+        mesh->setlattice(2);
+        canvas->add(std::move(mesh));
+        canvas->draw();
+        std::string const document = sink->release();
+        CHECK(document.find("<< /ShadingType 5 /ColorSpace /DeviceRGB /BitsPerCoordinate 16 /BitsPerComponent 8 /VerticesPerRow 2\n") != std::string::npos);
+        std::vector<std::vector<int>> const records = mesh_records(document, false);
+        CHECK(records.size() == vertices.size());
+        for (size_t i = 0; i < records.size() && i < vertices.size(); ++i)
+        {
+            CHECK(records[i] == record(-1, i));
+        }
+    }
+    // an index past the vertices is an error when the mesh is drawn
+    {
+        auto sink = eps::create_memory_sink();
+        auto canvas = eps::create_canvas(*sink);
+        auto mesh = std::make_unique<eps::mesh_t>(*canvas);
+        mesh->setvertices(vertices, colors);
+        mesh->settriangles({ 0, 1, 2, 2, 1, 6 });
+        canvas->add(std::move(mesh));
+        bool thrown = false;
+        try
+        {
+            canvas->draw();
+        }
+        catch (std::out_of_range const& e)
+        {
+            thrown = std::string(e.what()).find("E0104") != std::string::npos;
+        }
+        CHECK(thrown);
+    }
+}
+
+}; // namespace anonymous
+
+int main()
+{
+    test_redraw();
+    test_reorder_thick_strokes();
+    test_viewport_thick_stroke();
+    test_viewport_index_styles();
+    test_viewport_dashed();
+    test_polyline_same_output();
+    test_producers();
+    test_parallel();
+    test_bounding_box_runs();
+    test_canvases_on_threads();
+    test_no_current_point();
+    test_streaming_viewport();
+    test_resolved_styles();
+    test_released_styles();
+    test_arena();
+    test_fd_sink_error();
+    test_cache_report();
+    test_instancing();
+    test_markers();
+    test_image();
+    test_mesh();
+    if (failures)
+    {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "all tests passed\n";
+    return 0;
+}